@@ -3,8 +3,9 @@
 #include <iostream>
 #include <vector>
 #include "lexer.hpp"
-#include <vector>
+#include "ast_arena.hpp"
 #include <unordered_map>
+#include <mutex>
 
 class AST {
 public:
@@ -18,7 +19,9 @@ public:
 
     AST(AKind kind) { this->kind = kind; }
 
-    ~AST() { }
+    // Nodes live in the current AstArena and are never freed one by one.
+    static void* operator new(size_t size) { return AstArena::current()->allocate(size); }
+    static void operator delete(void*) { }
 };
 
 class TrueNode : public AST {
@@ -28,8 +31,8 @@ public:
 
 class ImportNode : public AST {
 public:
-    std::string path, re_name;
-    ImportNode(std::string path, std::string re_name) : AST(A_IMPORT) {
+    Atom path, re_name;
+    ImportNode(Atom path, Atom re_name) : AST(A_IMPORT) {
         this->path = path;
         this->re_name = re_name;
     }
@@ -57,10 +60,10 @@ public:
 
 class MemoryMallocNode : public AST {
 public:
-    std::string name;
-    std::vector<AST*> args;
+    Atom name;
+    AstList<AST*> args;
     bool is_call_c;
-    MemoryMallocNode(std::string name, std::vector<AST*> args, bool is_call_constructor) : AST(A_MEM_MALLOC) {
+    MemoryMallocNode(Atom name, const std::vector<AST*>& args, bool is_call_constructor) : AST(A_MEM_MALLOC) {
         this->name = name;
         this->args = args;
         this->is_call_c = is_call_constructor;
@@ -75,54 +78,41 @@ public:
         this->id = id;
         this->ipre = i;
     }
-
-    ~SelfDecNode() {
-        delete id;
-    }
 };
 
 class BinOpNode : public AST {
 public:
-    std::string op;
+    Atom op;
     AST *left, *right;
-    BinOpNode(std::string op, AST* left, AST* right) : AST(AST::A_BIN_OP) {
+    BinOpNode(Atom op, AST* left, AST* right) : AST(AST::A_BIN_OP) {
         this->op = op;
         this->right = right;
         this->left = left;
     }
-
-    ~BinOpNode() {
-        delete left;
-        delete right;
-    }
 };
 
 class MemberAccessNode : public AST {
 public:
     AST* parent;
-    std::string member;
-    MemberAccessNode(AST* left, std::string member) : AST(AST::A_MEMBER_ACCESS) {
+    Atom member;
+    MemberAccessNode(AST* left, Atom member) : AST(AST::A_MEMBER_ACCESS) {
         this->parent = left;
         this->member = member;
     }
-
-    ~MemberAccessNode() {
-        delete parent;
-    }
 };
 
 class StringNode : public AST {
 public:
-    std::string str;
-    StringNode(std::string str) : AST(AST::A_STRING) {
+    Atom str;
+    StringNode(Atom str) : AST(AST::A_STRING) {
         this->str = str;
     }
 };
 
 class IntegerNode : public AST {
 public:
-    std::string number;
-    IntegerNode(std::string number) : AST(AST::A_INT) {
+    Atom number;
+    IntegerNode(Atom number) : AST(AST::A_INT) {
         this->number = number;
     }
 };
@@ -138,8 +128,8 @@ public:
 
 class IdNode : public AST {
 public:
-    std::string id;
-    IdNode(std::string id) : AST(AST::A_ID) {
+    Atom id;
+    IdNode(Atom id) : AST(AST::A_ID) {
         this->id = id;
     }
 };
@@ -147,15 +137,11 @@ public:
 class CallNode : public AST {
 public:
     AST* func_name;
-    std::vector<AST*> args;
-    CallNode(AST* func_name, std::vector<AST*> args) : AST(AST::A_CALL) {
+    AstList<AST*> args;
+    CallNode(AST* func_name, const std::vector<AST*>& args) : AST(AST::A_CALL) {
         this->func_name = func_name;
         this->args = args;
     }
-
-    ~CallNode() {
-        delete func_name;
-    }
 };
 
 class ElementGetNode : public AST {
@@ -166,11 +152,6 @@ public:
         this->array_name = array_name;
         this->position = position;
     }
-
-    ~ElementGetNode() {
-        delete array_name;
-        delete position;
-    }
 };
 
 class NotNode : public AST {
@@ -179,16 +160,12 @@ public:
     NotNode(AST* expr) : AST(AST::A_NOT) {
         this->expr = expr;
     }
-
-    ~NotNode() {
-        delete expr;
-    }
 };
 
 class Block : public AST {
 public:
-    std::vector<AST*> codes;
-    Block(std::vector<AST*> codes) : AST(A_BLOCK) {
+    AstList<AST*> codes;
+    Block(const std::vector<AST*>& codes) : AST(A_BLOCK) {
         this->codes = codes;
     }
 };
@@ -203,12 +180,6 @@ public:
         this->if_false = if_false;
         this->if_true = if_true;
     }
-
-    ~IfNode() {
-        delete condition;
-        delete if_false;
-        delete if_true;
-    }
 };
 
 class WhileNode : public AST {
@@ -219,34 +190,29 @@ public:
         this->condition = condition;
         this->body = body;
     }
-
-    ~WhileNode() {
-        delete condition;
-        delete body;
-    }
 };
 
 class TypeNode : public AST {
 public:
-    std::string root_type;
-    std::string module_path, re_name;
+    Atom root_type;
+    Atom module_path, re_name;
     TypeNode* child_type;
     int args_size = 0;
 	
 	enum TKind { TK_NORMAL, TK_MODULE, TK_FUNCTION } __kind;
 	
-    TypeNode(std::string root_type) : AST(A_TYPE) {
+    TypeNode(Atom root_type) : AST(A_TYPE) {
         this->root_type = root_type;
 		__kind = TK_NORMAL;
     }
 
-    TypeNode(std::string module_path, std::string re_name) : AST(A_TYPE) {
+    TypeNode(Atom module_path, Atom re_name) : AST(A_TYPE) {
         this->module_path = module_path;
         this->re_name = re_name;
 		__kind = TK_MODULE;
     }
 
-    TypeNode(std::string root_type, TypeNode* child_type, int size = 0) : AST(A_TYPE) {
+    TypeNode(Atom root_type, TypeNode* child_type, int size = 0) : AST(A_TYPE) {
         this->root_type = root_type;
         this->child_type = child_type;
         this->args_size = size;
@@ -256,67 +222,50 @@ public:
 
 class LambdaNode : public AST {
 public:
-    std::vector<AST*> args;
+    AstList<AST*> args;
     Block* body;
     TypeNode* type__;
-    LambdaNode(std::vector<AST*> args, Block* body, TypeNode* type__): AST(AST::A_LAMBDA) {
+    LambdaNode(const std::vector<AST*>& args, Block* body, TypeNode* type__): AST(AST::A_LAMBDA) {
         this->args = args;
         this->body = body;
         this->type__ = type__;
     }
-
-    ~LambdaNode() {
-        delete body;
-    }
 };
 
 class VarDefineNode : public AST {
 public:
-    std::string name;
+    Atom name;
     TypeNode* type;
     AST* init_value;
-    VarDefineNode(std::string name, TypeNode* type,  AST* init_value = nullptr) : AST(A_VAR_DEF) {
+    VarDefineNode(Atom name, TypeNode* type,  AST* init_value = nullptr) : AST(A_VAR_DEF) {
         this->name = name;
         this->type = type;
         this->init_value = init_value;
     }
-
-    ~VarDefineNode() {
-        delete init_value;
-    }
 };
 
 class FunctionNode : public AST {
 public:
     Block* body;
-    std::string name;
-    std::vector<AST*> args;
-    FunctionNode(std::string name, std::vector<AST*> args, Block* body) : AST(A_FUNC_DEFINE) {
+    Atom name;
+    AstList<AST*> args;
+    FunctionNode(Atom name, const std::vector<AST*>& args, Block* body) : AST(A_FUNC_DEFINE) {
         this->body = body;
         this->name = name;
         this->args = args;
     }
-
-    ~FunctionNode() {
-        delete body;
-    }
 };
 
 class SelfOperator : public AST {
 public:
-    std::string op;
+    Atom op;
     AST* target;
     AST* value;
-    SelfOperator(std::string op, AST* target, AST* value) : AST(A_SELF_OPERA) {
+    SelfOperator(Atom op, AST* target, AST* value) : AST(A_SELF_OPERA) {
         this->op = op;
         this->target = target;
         this->value = value;
     }
-
-    ~SelfOperator() {
-        delete target;
-        delete value;
-    }
 };
 
 class ForNode : public AST {
@@ -331,13 +280,6 @@ public:
         this->change = change;
         this->body = body;
     }
-
-    ~ForNode() {
-        delete init;
-        delete is_continue;
-        delete change;
-        delete body;
-    }
 };
 
 class ContinueNode : public AST {
@@ -365,9 +307,9 @@ public:
 
 class SwitchNode : public AST {
 public:
-    std::vector<SwitchUnit*> units;
+    AstList<SwitchUnit*> units;
     AST* target_value;
-    SwitchNode(AST* target_value, std::vector<SwitchUnit*> units) : AST(A_SW) {
+    SwitchNode(AST* target_value, const std::vector<SwitchUnit*>& units) : AST(A_SW) {
         this->units = units;
         this->target_value = target_value;
     }
@@ -385,25 +327,24 @@ public:
     ReturnNode(AST* value) : AST(A_RETURN) {
         this->value = value;
     }
-
-    ~ReturnNode() { delete value; }
 };
 
 class ObjectNode : public AST {
 public:
-    std::string name;
+    Atom name;
 	
-	std::vector<std::string> extern_class;
+	AstList<Atom> extern_class;
 
     enum AccessState { PUBLIC, PRIVATE };
 
     std::unordered_map<std::string, AST*> members;
     std::unordered_map<std::string, AccessState> as;
-    ObjectNode(std::string name, std::unordered_map<std::string, AST*> members, std::unordered_map<std::string, AccessState> as, std::vector<std::string> ex) : AST(A_CLASS) {
-        this->members = members;
+    ObjectNode(Atom name, std::unordered_map<std::string, AST*> members, std::unordered_map<std::string, AccessState> as, const std::vector<Atom>& ex) : AST(A_CLASS) {
+        this->members = std::move(members);
         this->name = name;
-        this->as = as;
+        this->as = std::move(as);
 		this->extern_class = ex;
+        AstArena::current()->on_release(this, [](void* p) { ((ObjectNode*)p)->~ObjectNode(); });
     }
 };
 
@@ -414,16 +355,16 @@ public:
 
 class ArrayNode : public AST {
 public:
-    std::vector<AST*> elements;
-    ArrayNode(std::vector<AST*> elements) : AST(AST::A_ARRAY){
+    AstList<AST*> elements;
+    ArrayNode(const std::vector<AST*>& elements) : AST(AST::A_ARRAY){
         this->elements = elements;
     }
 };
 
 class FloatNode : public AST {
 public:
-    std::string number;
-    FloatNode(std::string number) : AST(AST::A_FLO) {
+    Atom number;
+    FloatNode(Atom number) : AST(AST::A_FLO) {
         this->number = number;
     }
 };
@@ -432,12 +373,21 @@ class Parser;
 
 typedef AST*(Parser::*CALLBACK_FUNCTION)();
 
+// Slices of a big source are parsed on several threads; the first error
+// wins and the others never print.
+std::mutex& error_lock() {
+    static std::mutex m;
+    return m;
+}
+
 void make_error(std::string error_type, std::string error_info, Position error_pos) {
+    error_lock().lock();
     std::cout << error_type << ": " << error_info << " at lin " << error_pos.lin << ", col " << error_pos.col << std::endl;
     exit(-1);
 }
 
 void make_error(std::string error_type, std::string error_info) {
+    error_lock().lock();
     std::cout << error_type << ": " << error_info << " at EOF" << std::endl;
     exit(-1);
 }
@@ -0,0 +1,167 @@
+#ifndef COPL_AST_ARENA_HPP
+#define COPL_AST_ARENA_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <new>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Bump allocator for syntax trees. Nodes, their child lists and the text of
+// identifiers and literals are carved out of AST_CHUNK_SIZE chunks and all
+// released together when the arena goes away; nothing in a tree is freed on
+// its own.
+//
+// A Parser owns an arena and installs it as the current one of its thread
+// while it lives, so the nodes the compiler creates on the way (types it
+// infers) land in the same arena and die with it. Imports compiled from
+// inside a compilation get arenas of their own, stacked on top.
+
+#define AST_CHUNK_SIZE (64 * 1024)
+
+struct AstArena {
+    AstArena() : previous(current_slot()) { current_slot() = this; }
+
+    ~AstArena() {
+        if (current_slot() == this)
+            current_slot() = previous;
+        for (auto& d : finalizers)
+            d.second(d.first);
+        for (auto c : chunks)
+            std::free(c);
+    }
+
+    AstArena(const AstArena&) = delete;
+    AstArena& operator=(const AstArena&) = delete;
+
+    static AstArena* current() {
+        AstArena* a = current_slot();
+        return a ? a : &global();
+    }
+
+    // Trees built with no parser around end up here, for the process.
+    static AstArena& global() {
+        static AstArena* g = new AstArena(0);
+        return *g;
+    }
+
+    void* allocate(size_t size) {
+        size = (size + 7) & ~(size_t)7;
+        if (size > (size_t)(end - top)) {
+            size_t want = size > AST_CHUNK_SIZE ? size : AST_CHUNK_SIZE;
+            top = (char*)std::malloc(want);
+            if (!top)
+                throw std::bad_alloc();
+            chunks.push_back(top);
+            end = top + want;
+        }
+        void* p = top;
+        top += size;
+        bytes += size;
+        return p;
+    }
+
+    template<typename T>
+    T* copy(const T* items, size_t count) {
+        if (!count)
+            return nullptr;
+        T* p = (T*)allocate(sizeof(T) * count);
+        std::memcpy((void*)p, items, sizeof(T) * count);
+        return p;
+    }
+
+    // Runs `fn(p)` when the arena is released; for the few nodes that hold
+    // standard containers.
+    void on_release(void* p, void (*fn)(void*)) { finalizers.emplace_back(p, fn); }
+
+    // The single copy of `text` in this arena.
+    const std::string* intern(std::string_view text) {
+        auto it = names.find(text);
+        if (it != names.end())
+            return it->second;
+        const std::string* s = &strings.emplace_back(text);
+        names.emplace(*s, s);
+        return s;
+    }
+
+    size_t bytes = 0;
+
+private:
+    explicit AstArena(int) : previous(nullptr) {}
+
+    static AstArena*& current_slot() {
+        static thread_local AstArena* slot = nullptr;
+        return slot;
+    }
+
+    AstArena* previous;
+    char* top = nullptr;
+    char* end = nullptr;
+    std::vector<char*> chunks;
+    std::vector<std::pair<void*, void (*)(void*)>> finalizers;
+    std::deque<std::string> strings;
+    std::unordered_map<std::string_view, const std::string*> names;
+};
+
+// An interned string: equal text is one object per arena, so a name is a
+// pointer wide and copying it is free. Reads as a const std::string&.
+class Atom {
+public:
+    Atom() : s(&empty_string()) {}
+    Atom(std::string_view text) : s(AstArena::current()->intern(text)) {}
+    Atom(const std::string& text) : Atom(std::string_view(text)) {}
+    Atom(const char* text) : Atom(std::string_view(text)) {}
+
+    operator const std::string&() const { return *s; }
+    const std::string& str() const { return *s; }
+    const char* c_str() const { return s->c_str(); }
+    size_t size() const { return s->size(); }
+    bool empty() const { return s->empty(); }
+
+private:
+    const std::string* s;
+
+    static const std::string& empty_string() {
+        static const std::string e;
+        return e;
+    }
+};
+
+inline bool operator==(const Atom& a, const Atom& b) { return a.str() == b.str(); }
+inline bool operator==(const Atom& a, const std::string& b) { return a.str() == b; }
+inline bool operator==(const std::string& a, const Atom& b) { return a == b.str(); }
+inline bool operator==(const Atom& a, const char* b) { return a.str() == b; }
+inline bool operator!=(const Atom& a, const Atom& b) { return !(a == b); }
+inline bool operator!=(const Atom& a, const std::string& b) { return !(a == b); }
+inline bool operator!=(const std::string& a, const Atom& b) { return !(a == b); }
+inline bool operator!=(const Atom& a, const char* b) { return !(a == b); }
+inline std::string operator+(const Atom& a, const std::string& b) { return a.str() + b; }
+inline std::string operator+(const std::string& a, const Atom& b) { return a + b.str(); }
+inline std::string operator+(const Atom& a, const char* b) { return a.str() + b; }
+inline std::string operator+(const char* a, const Atom& b) { return a + b.str(); }
+inline std::ostream& operator<<(std::ostream& os, const Atom& a) { return os << a.str(); }
+
+// A fixed list of tree nodes (or names) copied into the arena.
+template<typename T>
+struct AstList {
+    T* items = nullptr;
+    uint32_t count = 0;
+
+    AstList() {}
+    AstList(const std::vector<T>& v)
+        : items(AstArena::current()->copy(v.data(), v.size())), count((uint32_t)v.size()) {}
+
+    T* begin() const { return items; }
+    T* end() const { return items + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    T& operator[](size_t i) const { return items[i]; }
+};
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef COPL_BUILD_CACHE_HPP
+#define COPL_BUILD_CACHE_HPP
+
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "program_parser.hpp"
+#include "compiler.hpp"
+#include "code_writer.hpp"
+#include "function_cache.hpp"
+#include "source_file.hpp"
+#include "../resfile_types.hpp"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Compiled programs cached by content. A source is keyed by the hash of its
+// text, and the compiled file by that hash combined with the keys of the
+// .opl files it imports, so touching a module only recompiles the module and
+// the files importing it. Imports naming an .opl source are compiled through
+// the cache and linked against the cached .copl; other imports are left as
+// they are.
+//
+//   <dir>/<source hash>.deps   imported .opl paths, one per line
+//   <dir>/<key>.copl           the compiled program
+//   <dir>/<path hash>.funcs    functions of the last build of a path, so an
+//                              edit only recompiles the functions it touched
+struct BuildCache {
+    std::string dir;
+
+    explicit BuildCache(std::string dir) : dir(std::move(dir)) {
+        std::error_code ec;
+        std::filesystem::create_directories(this->dir, ec);
+        if (ec) {
+            printf("Cannot create cache directory: %s\n", this->dir.c_str());
+            exit(-1);
+        }
+    }
+
+    static std::string default_dir() {
+        const char* env = getenv("COPL_CACHE_DIR");
+        return (env && *env) ? env : ".copl_cache";
+    }
+
+    // Path of an up to date .copl for `source`, compiling it if needed. An
+    // entry is shaken down to what main reaches, an import keeps its
+    // top-level functions.
+    std::string get(const std::string& source, bool is_entry = false) {
+        auto it = done.find(source);
+        if (it != done.end()) {
+            if (it->second.empty()) {
+                printf("ImportError: '%s' imports itself\n", source.c_str());
+                exit(-1);
+            }
+            return it->second;
+        }
+        done[source] = "";
+
+        SourceFile file;
+        if (!file.open(source)) {
+            printf("Cannot open source file: %s\n", source.c_str());
+            exit(-1);
+        }
+        std::string_view text = file.text();
+        uint64_t hash = fnv1a(text, fnv1a(std::to_string(COPL_MAGIC) + "." + std::to_string(COPL_VERSION)));
+        std::string deps_file = dir + "/" + to_hex(hash) + ".deps";
+
+        std::string listed;
+        if (read_text(deps_file, listed)) {
+            std::vector<std::string> linked;
+            std::istringstream lines(listed);
+            for (std::string dep; std::getline(lines, dep);)
+                if (!dep.empty())
+                    linked.push_back(get(dep));
+            std::string target = program_path(hash, linked, is_entry);
+            if (std::filesystem::exists(target)) {
+                hits++;
+                return done[source] = target;
+            }
+        }
+
+        misses++;
+        std::vector<std::string> deps, linked;
+        report_lexing(source, text);
+        TimeReport::Scope parse(source, "parse");
+        ProgramParser parser(text);
+        parse.close();
+        CompileOutput opt;
+        ModuleManager* mg = new ModuleManager;
+        mg->resolve = [&](const std::string& path) {
+            if (!is_source(path))
+                return path;
+            deps.push_back(path);
+            linked.push_back(get(path));
+            return linked.back();
+        };
+        FunctionCache functions;
+        std::string funcs_file = dir + "/" + to_hex(fnv1a(source)) + ".funcs";
+        std::string previous;
+        if (read_text(funcs_file, previous))
+            functions.parse(previous);
+        TimeReport::Scope compile(source, "compile");
+        Compiler compiler(&opt, parser.ast, mg, &functions);
+        compile.close();
+        mg->resolve = nullptr;
+        reused += functions.reused;
+        compiled += functions.compiled;
+
+        std::string target = program_path(hash, linked, is_entry);
+        TimeReport::Scope save(source, "save");
+        std::string temp = temp_path(target);
+        save_code(temp, &opt, is_entry);
+        commit(temp, target);
+        save.close();
+        std::string list;
+        for (auto& d : deps)
+            list += d + "\n";
+        write_text(deps_file, list);
+        if (!functions.fresh.empty())
+            write_text(funcs_file, functions.serialize());
+        return done[source] = target;
+    }
+
+    size_t hits = 0, misses = 0;
+    // Functions taken from the .funcs files and ones compiled again.
+    size_t reused = 0, compiled = 0;
+
+private:
+    // Finished sources; an empty entry marks one being compiled.
+    std::unordered_map<std::string, std::string> done;
+
+    static bool is_source(const std::string& path) {
+        return path.size() > 4 && path.compare(path.size() - 4, 4, ".opl") == 0;
+    }
+
+    static uint64_t fnv1a(std::string_view data, uint64_t h = 0xcbf29ce484222325ULL) {
+        for (unsigned char c : data) {
+            h ^= c;
+            h *= 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    static std::string to_hex(uint64_t v) {
+        char buf[17];
+        snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)v);
+        return buf;
+    }
+
+    std::string program_path(uint64_t hash, const std::vector<std::string>& linked, bool is_entry) {
+        std::string deps = is_entry ? "entry\n" : "";
+        for (auto& l : linked)
+            deps += l + "\n";
+        return dir + "/" + to_hex(fnv1a(deps, hash)) + ".copl";
+    }
+
+    static bool read_text(const std::string& path, std::string& out) {
+        std::ifstream ifs(path, std::ios::binary);
+        if (!ifs)
+            return false;
+        std::ostringstream ss;
+        ss << ifs.rdbuf();
+        out = ss.str();
+        return true;
+    }
+
+    // Written aside and renamed so a concurrent run never sees half a file.
+    // Each writer has its own temp name, so two runs building the same entry
+    // cannot rename each other's partial output into place.
+    static void write_text(const std::string& path, const std::string& text) {
+        std::string temp = temp_path(path);
+        std::ofstream(temp, std::ios::binary) << text;
+        commit(temp, path);
+    }
+
+    static std::string temp_path(const std::string& path) {
+        static std::random_device seed;
+        static std::atomic<uint64_t> next(((uint64_t)seed() << 32) ^ seed());
+        return path + "." + to_hex(next++) + ".tmp";
+    }
+
+    static void commit(const std::string& from, const std::string& to) {
+        std::error_code ec;
+        std::filesystem::rename(from, to, ec);
+        if (ec) {
+            printf("Cannot write cache entry: %s\n", to.c_str());
+            exit(-1);
+        }
+    }
+};
+
+#endif
@@ -5,6 +5,15 @@
 #include "../running/program_loader.hpp"
 #include "../running/native_proc.hpp"
 #include "ast.hpp"
+#include "function_cache.hpp"
+#include "time_report.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <thread>
+#include <unordered_set>
 
 struct VarInfo {
 	std::string name;
@@ -20,65 +29,96 @@ struct ObjectInfo {
 	std::string name;
 	std::vector<ObjectInfo*> ext_class;
 	std::vector<VarInfo> info;
+	std::unordered_map<std::string, int> offsets;  // member name -> index in info
+	std::unordered_set<std::string> methods;
+	ObjectShape* shape = nullptr;
+	int shape_id = -1;
+	
+	bool has_method(const std::string& mname) const {
+		if (methods.count(mname))
+			return true;
+		for (auto i : ext_class)
+			if (i->has_method(mname))
+				return true;
+		return false;
+	}
 	
-	int get_offset(std::string vname) {
-		for (int i = 0; i < info.size(); ++i)
-			if (info[i].name == vname)
-				return i;
-		throw std::exception();
+	int get_offset(const std::string& vname) const {
+		auto it = offsets.find(vname);
+		if (it == offsets.end())
+			throw std::exception();
+		return it->second;
 	}
 	
-	bool var_is_exist(std::string vname) {
-		for (auto i : info)
-			if (i.name == vname)
-				return true;
-		return false;
+	bool var_is_exist(const std::string& vname) const {
+		return offsets.count(vname) != 0;
 	}
 	
-	VarInfo get_var_info(std::string vname) {
-		for (auto i : info)
-			if (i.name == vname)
-				return i;
-		throw std::exception();
+	const VarInfo& get_var_info(const std::string& vname) const {
+		return info[get_offset(vname)];
 	}
 };
 
+// Names are looked up through hash indexes kept next to the tables, which
+// map each name to its first declaration like the linear scans they replace.
 struct CompileOutput {
 	std::vector<Frame*> funcs;
 	std::vector<VarInfo> globals;
+	std::unordered_map<std::string, int> global_ids;
+	std::unordered_map<std::string, int> func_ids;
 	
 	int add_global(VarInfo info) {
 		globals.push_back(info);
+		global_ids.emplace(globals.back().name, globals.size() - 1);
 		return globals.size() - 1;
 	}
 	
-	TypeNode* get_var_type(std::string name) {
-		for (auto i : globals)
-			if (i.name == name)
-				return i.type;
-		throw std::exception();
+	int find_global(const std::string& name) {
+		auto it = global_ids.find(name);
+		return it == global_ids.end() ? -1 : it->second;
+	}
+	
+	TypeNode* get_var_type(const std::string& name) {
+		int i = find_global(name);
+		if (i < 0)
+			throw std::exception();
+		return globals[i].type;
 	}
 	
 	std::unordered_map<std::string, ObjectInfo> object_size_record;
+	std::vector<ObjectShape*> shapes;
+	// Every module the unit imports, as the VM should load it, by name.
+	std::vector<ImportRef> imports;
 	int fn_cnt = 0;
 	
-	void regist_class(std::string name, std::vector<VarInfo> members, std::vector<ObjectInfo*> _ext_class) {
+	void regist_class(std::string name, std::vector<VarInfo> members, std::vector<ObjectInfo*> _ext_class,
+	                  std::vector<std::string> methods) {
 		ObjectInfo inf;
 		inf.ext_class = _ext_class;
 		inf.name = name;
 		inf.info = members;
+		for (int i = 0; i < (int)members.size(); ++i)
+			inf.offsets.emplace(members[i].name, i);
+		inf.methods.insert(methods.begin(), methods.end());
+		ObjectShape* shape = new ObjectShape;
+		shape->name = name;
+		for (auto& m : members)
+			shape->members.push_back(m.name);
+		for (auto i : _ext_class)
+			shape->bases.push_back(i->shape);
+		inf.shape = shape;
+		inf.shape_id = shapes.size();
+		shapes.push_back(shape);
 		object_size_record[name] = inf;
 	}
 	
-	ObjectInfo get_class(std::string name) {
+	ObjectInfo& get_class(const std::string& name) {
 		return object_size_record[name];
 	}
 	
-	int find_function_by_name(std::string name) {
-		for (auto i : funcs)
-			if (i->func_name == name)
-				return i->func_id;
-		return -1;
+	int find_function_by_name(const std::string& name) {
+		auto it = func_ids.find(name);
+		return it == func_ids.end() ? -1 : it->second;
 	}
 	
 	Frame* find_function(int id) {
@@ -91,44 +131,42 @@ struct CompileOutput {
 	int get_cnt() { return ++fn_cnt; }
 	
 	int regist_function(Frame* func) {
-		funcs.push_back(func);
+		add_function(func);
 		return fn_cnt;
 	}
-};
-
-struct OperatorCommandUnit {
-	std::string label;
-	int op;
-	OperatorCommandUnit(int op) : op(op) {}
-	OperatorCommandUnit(std::string label) : label(label) {}
-};
-
-struct OperatorCommand {
-	std::string addr;
-	std::vector<OperatorCommandUnit> codes;
-	OperatorCommand(std::string addr, std::vector<OperatorCommandUnit> codes)
-		: addr(addr), codes(codes) {}
+	
+	void add_function(Frame* func) {
+		funcs.push_back(func);
+		func_ids.emplace(func->func_name, func->func_id);
+	}
 };
 
 struct Scope {
-	std::unordered_map<std::string, int> var_id;
-	std::unordered_map<std::string, TypeNode*> var_type;
+	struct Var {
+		int id;
+		TypeNode* type;
+	};
+	std::unordered_map<std::string, Var> vars;
 	
-	VarInfo get_var(std::string name) {
-		return {name, var_type[name], ObjectNode::PUBLIC};
+	const Var* find(const std::string& name) const {
+		auto it = vars.find(name);
+		return it == vars.end() ? nullptr : &it->second;
 	}
 	
-	void add_var(std::string name, int id, TypeNode* type) {
-		var_id[name] = id;
-		var_type[name] = type;
+	void add_var(const std::string& name, int id, TypeNode* type) {
+		vars[name] = {id, type};
 	}
 };
 
 struct Tmp {
 	std::vector<Scope> scopes;
 	Chunk* current;
-	std::vector<OperatorCommand> code_cache;
-	int addr_cnt = 0, id = -1, arg_size = 0;
+	// Code goes straight into current->op_codes. Jumps name their target by
+	// a label handle; the operand is left as 0, recorded in `patches` and
+	// filled in once the function is done.
+	std::vector<int> label_addr;
+	std::vector<std::pair<int, int>> patches;  // operand position, label
+	int id = -1, arg_size = 0;
 	std::string current_func_name;
 	
 	Tmp() {
@@ -158,8 +196,11 @@ struct ModuleManager {
 		return modules.find(name) != modules.end();
 	}
 	
+	// Maps an import path to the file the VM should load, see BuildCache.
+	std::function<std::string(const std::string&)> resolve;
+	
 	void add(std::string name, std::string path) {
-		modules[name] = Depend(name, path);
+		modules[name] = Depend(name, resolve ? resolve(path) : path);
 	}
 	
 	std::string get_path(std::string name) {
@@ -167,14 +208,58 @@ struct ModuleManager {
 	}
 };
 
+// One top-level function or method, compiled on its own. Its id and the
+// ids of its lambdas follow each other, as do the numbers of the lambda
+// names; both ranges are laid out before any code is generated.
+struct CodegenJob {
+	FunctionNode* node;
+	std::string class_name;
+	size_t index;
+	size_t globals;  // globals declared in front of it
+	int lambdas;     // lambdas found in the body
+	int first_id = 0, first_lambda = 0;
+	// Filled in by the worker, in the order the sequential compiler would
+	// have registered them.
+	std::vector<Frame*> funcs;
+	int used_ids = 0, used_lambdas = 0;
+	// With a FunctionCache: the fingerprint and the code of each frame
+	// before encoding.
+	uint64_t print = 0;
+	std::vector<std::vector<int>> ops;
+};
+
+struct CodegenPlan {
+	std::vector<CodegenJob> jobs;
+	// First registration of each function name: the job it comes from (-1
+	// for builtins) and its id.
+	std::unordered_map<std::string, std::pair<long, int>> names;
+	// Number of jobs laid out before each class was declared.
+	std::unordered_map<std::string, size_t> class_horizon;
+};
+
+// Programs made only of imports, globals, functions and classes are
+// compiled in two passes. The first one declares globals, imports and
+// classes in source order and lays out function ids; the second one
+// generates the functions on a few threads, each of which sees exactly the
+// globals, classes and functions the sequential compiler would have seen
+// at that point, so the output is the same byte for byte. Set
+// COPL_COMPILE_THREADS to override the number of threads.
+//
+// Given a FunctionCache, the second pass takes every function whose
+// fingerprint is unchanged from the cache instead of compiling it again.
 class Compiler {
 public:
-	Compiler(CompileOutput* t, std::vector<AST*> codes, ModuleManager* mg) {
+	Compiler(CompileOutput* t, std::vector<AST*> codes, ModuleManager* mg, FunctionCache* cache = nullptr) {
 		this->t_codes = codes;
 		this->target = t;
 		this->mg = mg;
+		this->cache = cache;
 		regist_native_proc();
 		compile_all();
+		for (auto& m : mg->modules)
+			target->imports.emplace_back(m.second.path, m.first);
+		std::sort(target->imports.begin(), target->imports.end(),
+		          [](const ImportRef& a, const ImportRef& b) { return a.second < b.second; });
 	}
 	
 	ModuleManager* mg;
@@ -234,9 +319,19 @@ public:
 		popback->args_len = 1;
 		popback->func_id = target->get_cnt();
 		target->regist_function(popback);
+		
+		Frame* snap = new Frame(&snapshot, "snapshot");
+		snap->args_len = 1;
+		snap->func_id = target->get_cnt();
+		target->regist_function(snap);
 	}
 	
 	void compile_all() {
+		size_t threads = compile_threads();
+		if ((threads > 1 || cache) && can_compile_in_parallel()) {
+			compile_in_parallel(threads);
+			return;
+		}
 		for (auto i : t_codes) {
 			if (i->kind == AST::A_VAR_DEF) {
 				VarInfo info;
@@ -244,7 +339,7 @@ public:
 				info.type = ((VarDefineNode*)i)->type;
 				target->add_global(info);
 			} else {
-				visit_all(i, "", "");
+				visit_all(i, -1, -1);
 			}
 		}
 	}
@@ -255,80 +350,622 @@ public:
 
 private:
 	Tmp code_tmp;
+	CodegenPlan* plan = nullptr;
+	CodegenJob* job = nullptr;
+	FunctionCache* cache = nullptr;
+	
+	Compiler(Compiler& parent, CodegenPlan* plan, CodegenJob* job) {
+		this->mg = parent.mg;
+		this->target = parent.target;
+		this->cache = parent.cache;
+		this->current_class = job->class_name;
+		this->plan = plan;
+		this->job = job;
+	}
 	
-	void full_back() {
-		std::unordered_map<std::string, int> label_to_addr;
-		int addr = 0;
-		for (auto& cmd : code_tmp.code_cache) {
-			label_to_addr[cmd.addr] = addr;
-			addr += cmd.codes.size();
-		}
-		for (auto& cmd : code_tmp.code_cache) {
-			for (auto& unit : cmd.codes) {
-				if (unit.label.empty()) code_tmp.current->op_codes.push_back(unit.op);
-				else code_tmp.current->op_codes.push_back(label_to_addr[unit.label]);
+	static size_t compile_threads() {
+		const char* env = getenv("COPL_COMPILE_THREADS");
+		if (env && *env)
+			return (size_t)std::max(1, atoi(env));
+		return std::max(1u, std::thread::hardware_concurrency());
+	}
+	
+	bool can_compile_in_parallel() {
+		std::unordered_set<std::string> classes;
+		bool seen_code = false;
+		size_t jobs = 0;
+		for (auto i : t_codes) {
+			switch (i->kind) {
+				case AST::A_VAR_DEF:
+					break;
+				case AST::A_IMPORT:
+					if (seen_code) return false;
+					break;
+				case AST::A_FUNC_DEFINE:
+					if (count_lambdas(((FunctionNode*)i)->body) < 0) return false;
+					seen_code = true, ++jobs;
+					break;
+				case AST::A_CLASS: {
+					auto node = (ObjectNode*)i;
+					if (!classes.insert(node->name).second) return false;
+					for (auto& p : node->members) {
+						if (p.second->kind != AST::A_FUNC_DEFINE) continue;
+						if (count_lambdas(((FunctionNode*)p.second)->body) < 0) return false;
+						++jobs;
+					}
+					seen_code = true;
+					break;
+				}
+				default:
+					return false;
+			}
+		}
+		return jobs >= 2;
+	}
+	
+	// Lambdas in a function body, or -1 when it nests a function or class.
+	static int count_lambdas(AST* node) {
+		if (!node) return 0;
+		int n = 0;
+		auto add = [&](AST* child) {
+			int c = count_lambdas(child);
+			n = (c < 0 || n < 0) ? -1 : n + c;
+		};
+		switch (node->kind) {
+			case AST::A_FUNC_DEFINE:
+			case AST::A_CLASS:     return -1;
+			case AST::A_IF:        add(((IfNode*)node)->condition); add(((IfNode*)node)->if_true); add(((IfNode*)node)->if_false); break;
+			case AST::A_BLOCK:     for (auto c : ((Block*)node)->codes) add(c); break;
+			case AST::A_WHILE:     add(((WhileNode*)node)->condition); add(((WhileNode*)node)->body); break;
+			case AST::A_FOR: {
+				auto f = (ForNode*)node;
+				add(f->init); add(f->is_continue); add(f->change); add(f->body);
+				break;
+			}
+			case AST::A_RETURN:    add(((ReturnNode*)node)->value); break;
+			case AST::A_SW:
+				add(((SwitchNode*)node)->target_value);
+				for (auto u : ((SwitchNode*)node)->units) { add(u->value); add(u->stmt); }
+				break;
+			case AST::A_BIN_OP:    add(((BinOpNode*)node)->left); add(((BinOpNode*)node)->right); break;
+			case AST::A_BIT_NOT:   add(((BitNotNode*)node)->expr); break;
+			case AST::A_NOT:       add(((NotNode*)node)->expr); break;
+			case AST::A_MEMBER_ACCESS: add(((MemberAccessNode*)node)->parent); break;
+			case AST::A_ELEMENT_GET: add(((ElementGetNode*)node)->array_name); add(((ElementGetNode*)node)->position); break;
+			case AST::A_CALL:      add(((CallNode*)node)->func_name); for (auto a : ((CallNode*)node)->args) add(a); break;
+			case AST::A_ARRAY:     for (auto e : ((ArrayNode*)node)->elements) add(e); break;
+			case AST::A_SELF_INC:  add(((SelfIncNode*)node)->id); break;
+			case AST::A_SELF_DEC:  add(((SelfDecNode*)node)->id); break;
+			case AST::A_VAR_DEF:   add(((VarDefineNode*)node)->init_value); break;
+			case AST::A_SELF_OPERA: add(((SelfOperator*)node)->target); add(((SelfOperator*)node)->value); break;
+			case AST::A_MEM_MALLOC: for (auto a : ((MemoryMallocNode*)node)->args) add(a); break;
+			case AST::A_LAMBDA:    n = 1; add(((LambdaNode*)node)->body); break;
+			default: break;
+		}
+		return n;
+	}
+	
+	void add_job(CodegenPlan& p, FunctionNode* fn, const std::string& class_name) {
+		CodegenJob j;
+		j.node = fn;
+		j.class_name = class_name;
+		j.index = p.jobs.size();
+		j.globals = target->globals.size();
+		j.lambdas = count_lambdas(fn->body);
+		p.jobs.push_back(std::move(j));
+	}
+	
+	// Hands out ids and lambda numbers to the jobs in source order and
+	// records where every function name is first registered.
+	void layout(CodegenPlan& p) {
+		int id = target->fn_cnt, lambda = lambda_count;
+		p.names.clear();
+		for (auto f : target->funcs)
+			p.names.emplace(f->func_name, std::make_pair(-1L, f->func_id));
+		for (auto& j : p.jobs) {
+			j.first_id = id + 1;
+			j.first_lambda = lambda;
+			for (int k = 0; k < j.lambdas; ++k)
+				p.names.emplace("lambda_" + std::to_string(lambda + k), std::make_pair((long)j.index, j.first_id + 1 + k));
+			p.names.emplace(j.node->name, std::make_pair((long)j.index, j.first_id));
+			id += 1 + j.lambdas;
+			lambda += j.lambdas;
+		}
+	}
+	
+	void compile_in_parallel(size_t threads) {
+		CodegenPlan p;
+		for (auto i : t_codes) {
+			if (i->kind == AST::A_VAR_DEF) {
+				VarInfo info;
+				info.name = ((VarDefineNode*)i)->name;
+				info.type = ((VarDefineNode*)i)->type;
+				target->add_global(info);
+			} else if (i->kind == AST::A_IMPORT) {
+				visit_import_node(i);
+			} else if (i->kind == AST::A_FUNC_DEFINE) {
+				add_job(p, (FunctionNode*)i, "");
+			} else {
+				auto node = (ObjectNode*)i;
+				auto methods = declare_class(node);
+				p.class_horizon[node->name] = p.jobs.size();
+				for (auto fn : methods)
+					add_job(p, fn, node->name);
+			}
+		}
+		layout(p);
+		
+		// A job whose lambdas were miscounted still compiled right, but the
+		// ones after it were laid out wrong and go again.
+		for (size_t from = 0; from < p.jobs.size();) {
+			run_jobs(p, from, threads);
+			size_t bad = p.jobs.size();
+			for (size_t k = from; k < p.jobs.size(); ++k) {
+				if (p.jobs[k].used_lambdas != p.jobs[k].lambdas) {
+					bad = k;
+					break;
+				}
+			}
+			if (bad == p.jobs.size()) break;
+			p.jobs[bad].lambdas = p.jobs[bad].used_lambdas;
+			layout(p);
+			from = bad + 1;
+		}
+		
+		for (auto& j : p.jobs) {
+			for (auto f : j.funcs)
+				target->add_function(f);
+			target->fn_cnt = j.first_id + j.used_ids - 1;
+			lambda_count = j.first_lambda + j.used_lambdas;
+		}
+		if (cache) {
+			std::unordered_map<int, const std::string*> func_names;
+			for (auto f : target->funcs)
+				func_names.emplace(f->func_id, &f->func_name);
+			for (auto& j : p.jobs)
+				cache->fresh[j.print] = cache_entry(j, func_names);
+		}
+	}
+	
+	void run_jobs(CodegenPlan& p, size_t from, size_t threads) {
+		for (size_t k = from; k < p.jobs.size(); ++k) {
+			p.jobs[k].funcs.clear();
+			p.jobs[k].ops.clear();
+			p.jobs[k].used_ids = p.jobs[k].used_lambdas = 0;
+		}
+		std::atomic<size_t> next(from);
+		std::atomic<size_t> reused(0);
+		auto work = [&] {
+			// Constants and inferred types stay off the shared allocators.
+			PoolAllocator pool;
+			AstArena arena;
+			for (size_t k; (k = next++) < p.jobs.size();) {
+				Compiler worker(*this, &p, &p.jobs[k]);
+				if (cache) {
+					p.jobs[k].print = worker.fingerprint();
+					if (auto e = cache->find(p.jobs[k].print)) {
+						worker.reuse(*e);
+						++reused;
+						continue;
+					}
+				}
+				worker.visit_func_node(p.jobs[k].node);
+			}
+		};
+		std::vector<std::thread> workers;
+		for (size_t t = 0; t < std::min(threads, p.jobs.size() - from); ++t)
+			workers.emplace_back(work);
+		for (auto& w : workers)
+			w.join();
+		if (cache) {
+			cache->reused += reused;
+			cache->compiled += p.jobs.size() - from - reused;
+			if (TimeReport* report = TimeReport::active())
+				report->reused += reused;
+		}
+	}
+	
+	// Hashes the job's declaration with what every name in it stood for
+	// when it was compiled: functions by whether they exist, globals and
+	// classes by their types and layouts, modules by their paths. Ids and
+	// shape ids are left out; reuse() relocates them.
+	uint64_t fingerprint() {
+		Fingerprint fp;
+		std::unordered_set<std::string> refs;
+		fp.add(job->class_name);
+		hash_node(fp, job->node, refs);
+		refs.insert(job->class_name);
+		
+		std::vector<std::string> names(refs.begin(), refs.end());
+		std::sort(names.begin(), names.end());
+		std::vector<std::string> classes;
+		std::unordered_set<std::string> seen;
+		auto use_class = [&](const std::string& name) {
+			if (find_class(name) && seen.insert(name).second)
+				classes.push_back(name);
+		};
+		for (auto& name : names) {
+			fp.add(name);
+			int id = find_function(name);
+			fp.add((int64_t)(id >= 0));
+			if (!name.compare(0, 7, "lambda_"))
+				fp.add((int64_t)id);
+			int g = find_global(name);
+			if (g >= 0)
+				hash_type(fp, target->globals[g].type, &refs);
+			fp.add((int64_t)g);
+			auto module = mg->modules.find(name);
+			fp.add((int64_t)(module != mg->modules.end()));
+			if (module != mg->modules.end())
+				fp.add(module->second.path);
+			use_class(name);
+		}
+		for (auto& name : refs)
+			use_class(name);
+		// Member types reach classes the body never names.
+		for (size_t c = 0; c < classes.size(); ++c) {
+			ObjectInfo* info = find_class(classes[c]);
+			fp.add(classes[c]);
+			std::unordered_set<std::string> member_types;
+			for (auto& v : info->info) {
+				fp.add(v.name);
+				fp.add(v.origin_class);
+				fp.add((int64_t)v.as);
+				hash_type(fp, v.type, &member_types);
+			}
+			std::vector<std::string> methods(info->methods.begin(), info->methods.end());
+			std::sort(methods.begin(), methods.end());
+			for (auto& m : methods)
+				fp.add(m);
+			for (auto base : info->ext_class) {
+				fp.add(base->name);
+				use_class(base->name);
+			}
+			fp.add((int64_t)(find_function(classes[c] + "$constructor") >= 0));
+			std::vector<std::string> more(member_types.begin(), member_types.end());
+			std::sort(more.begin(), more.end());
+			for (auto& t : more)
+				use_class(t);
+		}
+		if (job->node->name == "main") {
+			std::map<std::string, std::string> modules;
+			for (auto& m : mg->modules)
+				modules[m.first] = m.second.path;
+			for (auto& m : modules)
+				fp.add(m.first), fp.add(m.second);
+		}
+		return fp.h;
+	}
+	
+	static void hash_type(Fingerprint& fp, TypeNode* type, std::unordered_set<std::string>* refs) {
+		if (!type) {
+			fp.add((int64_t)-1);
+			return;
+		}
+		fp.add((int64_t)type->__kind);
+		fp.add(type->root_type);
+		fp.add((int64_t)type->args_size);
+		refs->insert(type->root_type);
+		if (type->__kind == TypeNode::TK_FUNCTION)
+			hash_type(fp, type->child_type, refs);
+		else if (type->__kind == TypeNode::TK_MODULE)
+			fp.add(type->module_path), fp.add(type->re_name);
+	}
+	
+	// The whole tree below `node`, collecting the names it mentions.
+	static void hash_node(Fingerprint& fp, AST* node, std::unordered_set<std::string>& refs) {
+		if (!node) {
+			fp.add((int64_t)-1);
+			return;
+		}
+		fp.add((int64_t)node->kind);
+		auto name = [&](const std::string& n) {
+			fp.add(n);
+			refs.insert(n);
+		};
+		switch (node->kind) {
+			case AST::A_IF:        hash_node(fp, ((IfNode*)node)->condition, refs); hash_node(fp, ((IfNode*)node)->if_true, refs); hash_node(fp, ((IfNode*)node)->if_false, refs); break;
+			case AST::A_BLOCK:     fp.add((int64_t)((Block*)node)->codes.size()); for (auto c : ((Block*)node)->codes) hash_node(fp, c, refs); break;
+			case AST::A_STRING:    fp.add(((StringNode*)node)->str); break;
+			case AST::A_INT:       fp.add(((IntegerNode*)node)->number); break;
+			case AST::A_FLO:       fp.add(((FloatNode*)node)->number); break;
+			case AST::A_WHILE:     hash_node(fp, ((WhileNode*)node)->condition, refs); hash_node(fp, ((WhileNode*)node)->body, refs); break;
+			case AST::A_FOR: {
+				auto f = (ForNode*)node;
+				hash_node(fp, f->init, refs); hash_node(fp, f->is_continue, refs); hash_node(fp, f->change, refs); hash_node(fp, f->body, refs);
+				break;
+			}
+			case AST::A_RETURN:    hash_node(fp, ((ReturnNode*)node)->value, refs); break;
+			case AST::A_BIN_OP:    fp.add(((BinOpNode*)node)->op); hash_node(fp, ((BinOpNode*)node)->left, refs); hash_node(fp, ((BinOpNode*)node)->right, refs); break;
+			case AST::A_BIT_NOT:   hash_node(fp, ((BitNotNode*)node)->expr, refs); break;
+			case AST::A_NOT:       hash_node(fp, ((NotNode*)node)->expr, refs); break;
+			case AST::A_MEMBER_ACCESS: name(((MemberAccessNode*)node)->member); hash_node(fp, ((MemberAccessNode*)node)->parent, refs); break;
+			case AST::A_ID:        name(((IdNode*)node)->id); break;
+			case AST::A_ELEMENT_GET: hash_node(fp, ((ElementGetNode*)node)->array_name, refs); hash_node(fp, ((ElementGetNode*)node)->position, refs); break;
+			case AST::A_CALL:
+				hash_node(fp, ((CallNode*)node)->func_name, refs);
+				fp.add((int64_t)((CallNode*)node)->args.size());
+				for (auto a : ((CallNode*)node)->args) hash_node(fp, a, refs);
+				break;
+			case AST::A_ARRAY:
+				fp.add((int64_t)((ArrayNode*)node)->elements.size());
+				for (auto e : ((ArrayNode*)node)->elements) hash_node(fp, e, refs);
+				break;
+			case AST::A_SELF_INC:  fp.add((int64_t)((SelfIncNode*)node)->ipre); hash_node(fp, ((SelfIncNode*)node)->id, refs); break;
+			case AST::A_SELF_DEC:  fp.add((int64_t)((SelfDecNode*)node)->ipre); hash_node(fp, ((SelfDecNode*)node)->id, refs); break;
+			case AST::A_VAR_DEF: {
+				auto vd = (VarDefineNode*)node;
+				name(vd->name);
+				hash_type(fp, vd->type, &refs);
+				hash_node(fp, vd->init_value, refs);
+				break;
 			}
+			case AST::A_FUNC_DEFINE: {
+				auto fn = (FunctionNode*)node;
+				name(fn->name);
+				fp.add((int64_t)fn->args.size());
+				for (auto a : fn->args) hash_node(fp, a, refs);
+				hash_node(fp, fn->body, refs);
+				break;
+			}
+			case AST::A_SELF_OPERA: fp.add(((SelfOperator*)node)->op); hash_node(fp, ((SelfOperator*)node)->target, refs); hash_node(fp, ((SelfOperator*)node)->value, refs); break;
+			case AST::A_MEM_MALLOC: {
+				auto mm = (MemoryMallocNode*)node;
+				name(mm->name);
+				name(mm->name + "$constructor");
+				fp.add((int64_t)mm->is_call_c);
+				fp.add((int64_t)mm->args.size());
+				for (auto a : mm->args) hash_node(fp, a, refs);
+				break;
+			}
+			case AST::A_LAMBDA: {
+				auto lb = (LambdaNode*)node;
+				fp.add((int64_t)lb->args.size());
+				for (auto a : lb->args) hash_node(fp, a, refs);
+				hash_type(fp, lb->type__, &refs);
+				hash_node(fp, lb->body, refs);
+				break;
+			}
+			case AST::A_SW:
+				hash_node(fp, ((SwitchNode*)node)->target_value, refs);
+				fp.add((int64_t)((SwitchNode*)node)->units.size());
+				for (auto u : ((SwitchNode*)node)->units) {
+					fp.add((int64_t)u->is_default);
+					hash_node(fp, u->value, refs);
+					hash_node(fp, u->stmt, refs);
+				}
+				break;
+			default: break;
+		}
+	}
+	
+	// Takes the job's functions from a cache entry, moving its own ids and
+	// lambda names to where this build put them and looking the others up
+	// again by name.
+	void reuse(const FunctionCache::Entry& e) {
+		std::unordered_map<int, int> moved_funcs, moved_shapes;
+		for (auto& r : e.func_refs)
+			moved_funcs[r.first] = find_function(r.second);
+		for (auto& r : e.shape_refs) {
+			ObjectInfo* info = find_class(r.second);
+			moved_shapes[r.first] = info ? info->shape_id : -1;
+		}
+		auto move_func = [&](int id) {
+			if (id >= e.first_id && id < e.first_id + e.ids)
+				return id - e.first_id + job->first_id;
+			auto it = moved_funcs.find(id);
+			return it == moved_funcs.end() ? id : it->second;
+		};
+		for (auto& f : e.funcs) {
+			Chunk* chunk = new Chunk;
+			chunk->op_codes = f.ops;
+			for (size_t i = 0; i < chunk->op_codes.size();) {
+				int op = chunk->op_codes[i];
+				if (op == OP_CALL || op == OP_LOAD_FUNC_ADDR)
+					chunk->op_codes[i + 1] = move_func(chunk->op_codes[i + 1]);
+				else if (op == OP_NEW_INSTANCE && moved_shapes.count(chunk->op_codes[i + 1]))
+					chunk->op_codes[i + 1] = moved_shapes[chunk->op_codes[i + 1]];
+				i += 1 + instruction_info[op].arg_count;
+			}
+			chunk->names = f.names;
+			chunk->const_pool = f.consts;
+			job->ops.push_back(chunk->op_codes);
+			chunk->encode();
+			auto* frame = new Frame(chunk);
+			frame->is_lambda = f.is_lambda;
+			frame->func_id = move_func(f.id);
+			frame->func_name = f.is_lambda
+				? "lambda_" + std::to_string(atoi(f.name.c_str() + 7) - e.first_lambda + job->first_lambda)
+				: f.name;
+			frame->args_len = f.args_len;
+			job->funcs.push_back(frame);
+		}
+		job->used_ids = e.ids;
+		job->used_lambdas = e.lambdas;
+	}
+	
+	FunctionCache::Entry cache_entry(const CodegenJob& j, const std::unordered_map<int, const std::string*>& func_names) {
+		FunctionCache::Entry e;
+		e.first_id = j.first_id;
+		e.first_lambda = j.first_lambda;
+		e.ids = j.used_ids;
+		e.lambdas = j.used_lambdas;
+		std::unordered_set<int> refs, shapes;
+		for (size_t k = 0; k < j.funcs.size(); ++k) {
+			Frame* frame = j.funcs[k];
+			FunctionCache::Func f;
+			f.name = frame->func_name;
+			f.is_lambda = frame->is_lambda;
+			f.id = frame->func_id;
+			f.args_len = frame->args_len;
+			f.ops = j.ops[k];
+			f.names = frame->codes->names;
+			f.consts = frame->codes->const_pool;
+			for (size_t i = 0; i < f.ops.size(); i += 1 + instruction_info[f.ops[i]].arg_count) {
+				int op = f.ops[i];
+				if (instruction_info[op].arg_count == 0)
+					continue;
+				int arg = f.ops[i + 1];
+				if ((op == OP_CALL || op == OP_LOAD_FUNC_ADDR) && arg >= 0 && (arg < e.first_id || arg >= e.first_id + e.ids))
+					refs.insert(arg);
+				else if (op == OP_NEW_INSTANCE && arg >= 0 && arg < (int)target->shapes.size())
+					shapes.insert(arg);
+			}
+			e.funcs.push_back(std::move(f));
+		}
+		for (int id : refs) {
+			auto it = func_names.find(id);
+			if (it != func_names.end())
+				e.func_refs.emplace_back(id, *it->second);
+		}
+		for (int id : shapes)
+			e.shape_refs.emplace_back(id, target->shapes[id]->name);
+		return e;
+	}
+	
+	int next_function_id() {
+		return job ? job->first_id + job->used_ids++ : target->get_cnt();
+	}
+	
+	// Same value regist_function gives back: the last id handed out.
+	int register_function(Frame* f) {
+		if (!job) return target->regist_function(f);
+		job->funcs.push_back(f);
+		return job->first_id + job->used_ids - 1;
+	}
+	
+	int find_function(const std::string& name) {
+		if (!job) return target->find_function_by_name(name);
+		auto it = plan->names.find(name);
+		if (it != plan->names.end() && it->second.first < (long)job->index)
+			return it->second.second;
+		for (auto f : job->funcs)
+			if (f->func_name == name)
+				return f->func_id;
+		return -1;
+	}
+	
+	// Index of a global declared before the function being compiled, or -1.
+	int find_global(const std::string& name) {
+		int i = target->find_global(name);
+		return (i >= 0 && (!job || (size_t)i < job->globals)) ? i : -1;
+	}
+	
+	ObjectInfo* find_class(const std::string& name) {
+		auto it = target->object_size_record.find(name);
+		if (it == target->object_size_record.end())
+			return nullptr;
+		if (job) {
+			auto h = plan->class_horizon.find(name);
+			if (h == plan->class_horizon.end() || h->second > job->index)
+				return nullptr;
 		}
+		return &it->second;
+	}
+	
+	const ObjectInfo& get_class(const std::string& name) {
+		if (!job) return target->get_class(name);
+		static const ObjectInfo missing;
+		ObjectInfo* info = find_class(name);
+		return info ? *info : missing;
+	}
+	
+	int class_shape_id(const std::string& name) {
+		if (!job) return target->object_size_record[name].shape_id;
+		ObjectInfo* info = find_class(name);
+		return info ? info->shape_id : -1;
+	}
+	
+	void full_back() {
+		auto& ops = code_tmp.current->op_codes;
+		for (auto& p : code_tmp.patches)
+			ops[p.first] = code_tmp.label_addr[p.second];
+		code_tmp.patches.clear();
 	}
 	
 	inline int add_const(STACK_VALUE* value) { return code_tmp.current->add_const(value); }
-	inline std::string make_addr() { return "L" + std::to_string(code_tmp.addr_cnt++); }
-	void emit(std::string addr, std::vector<OperatorCommandUnit> codes) {
-		code_tmp.code_cache.push_back(OperatorCommand(addr, codes));
+	
+	inline int new_label() {
+		code_tmp.label_addr.push_back(0);
+		return code_tmp.label_addr.size() - 1;
+	}
+	
+	// Binds `label` here, on a NOP that jumps land on.
+	inline void place(int label) {
+		code_tmp.label_addr[label] = code_tmp.current->op_codes.size();
+		emit({OP_NOP});
+	}
+	
+	inline void emit(std::initializer_list<int> codes) {
+		auto& ops = code_tmp.current->op_codes;
+		ops.insert(ops.end(), codes);
+	}
+	
+	// A break or continue with no loop around it has label -1 and jumps to 0.
+	inline void emit_jump(int op, int label) {
+		auto& ops = code_tmp.current->op_codes;
+		ops.push_back(op);
+		if (label >= 0)
+			code_tmp.patches.emplace_back(ops.size(), label);
+		ops.push_back(0);
 	}
 	
 	int emit_function(bool is_lambda) {
 		full_back();
+		if (job && cache)
+			job->ops.push_back(code_tmp.current->op_codes);
+		code_tmp.current->encode();
 		auto* f = new Frame(code_tmp.current);
 		f->is_lambda = is_lambda;
 		f->func_id = code_tmp.id;
 		f->func_name = code_tmp.current_func_name;
 		f->args_len = code_tmp.arg_size;
-		return target->regist_function(f);
+		return register_function(f);
 	}
 	
 	inline void create_scope() { code_tmp.scopes.emplace_back(); }
 	inline void leave_scope() { if (!code_tmp.scopes.empty()) code_tmp.scopes.pop_back(); }
 	
-	VarInfo get_var(std::string name) {
+	// Innermost local of that name.
+	const Scope::Var* find_local(const std::string& name) {
+		for (int i = code_tmp.scopes.size() - 1; i >= 0; --i)
+			if (auto v = code_tmp.scopes[i].find(name))
+				return v;
+		return nullptr;
+	}
+	
+	VarInfo get_var(const std::string& name) {
 		if (name == "this") {
 			return {name, new TypeNode(current_class), ObjectNode::PUBLIC};
 		}
-		for (int i = code_tmp.scopes.size() - 1; i >= 0; --i)
-			if (code_tmp.scopes[i].var_type.find(name) != code_tmp.scopes[i].var_type.end())
-				return code_tmp.scopes[i].get_var(name);
-		return {name, target->get_var_type(name), ObjectNode::PUBLIC};
+		if (auto v = find_local(name))
+			return {name, v->type, ObjectNode::PUBLIC};
+		int g = find_global(name);
+		if (g < 0)
+			throw std::exception();
+		return {name, target->globals[g].type, ObjectNode::PUBLIC};
 	}
 	
-	bool var_is_exist(std::string name) {
+	bool var_is_exist(const std::string& name) {
 		if (name == "this" && !current_class.empty()) return true;
-		for (int i = code_tmp.scopes.size() - 1; i >= 0; --i)
-			if (code_tmp.scopes[i].var_type.find(name) != code_tmp.scopes[i].var_type.end())
-				return true;
-		for (auto i : target->globals)
-			if (i.name == name)
-				return true;
-		return false;
+		return find_local(name) || find_global(name) >= 0;
 	}
 	
-	void add_var(std::string name, int id, TypeNode* type) {
+	void add_var(const std::string& name, int id, TypeNode* type) {
 		code_tmp.scopes.back().add_var(name, id, type);
 	}
 	
-	int get_name_id(std::string name) {
-		for (int j = code_tmp.scopes.size() - 1; j >= 0; --j)
-			for (auto& p : code_tmp.scopes[j].var_id)
-				if (p.first == name)
-					return p.second;
-		return -1;
+	int get_name_id(const std::string& name) {
+		auto v = find_local(name);
+		return v ? v->id : -1;
 	}
 	
-	void load_name(std::string name) {
-		emit(make_addr(), {OP_LOAD_NAME, get_name_id(name)});
+	void load_name(const std::string& name) {
+		emit({OP_LOAD_NAME, get_name_id(name)});
 	}
 	
-	void set_name(std::string name) {
-		emit(make_addr(), {OP_SET_NAME, get_name_id(name)});
+	void set_name(const std::string& name) {
+		emit({OP_SET_NAME, get_name_id(name)});
 	}
 	
 	TypeNode* make_type(std::string root, TypeNode* chi = nullptr) {
@@ -338,18 +975,17 @@ private:
 	TypeNode* get_expression_type(AST* expr) {
 		switch (expr->kind) {
 			case AST::A_ID: {
-				std::string name = ((IdNode*)expr)->id;
+				const std::string& name = ((IdNode*)expr)->id;
 				if (mg->exist(name))
 					return new TypeNode(mg->get_path(name), name);
-				for (int i = code_tmp.scopes.size() - 1; i >= 0; --i)
-					if (code_tmp.scopes[i].var_type.find(name) != code_tmp.scopes[i].var_type.end())
-						return code_tmp.scopes[i].var_type[name];
+				if (auto v = find_local(name))
+					return v->type;
 				return get_var(name).type;
 			}
 			case AST::A_MEMBER_ACCESS: {
 				auto ma = (MemberAccessNode*)expr;
 				TypeNode* parent_type = get_expression_type(ma->parent);
-				return target->get_class(parent_type->root_type).get_var_info(ma->member).type;
+				return get_class(parent_type->root_type).get_var_info(ma->member).type;
 			}
 			case AST::A_ELEMENT_GET: {
 				auto eg = (ElementGetNode*)expr;
@@ -376,37 +1012,37 @@ private:
 	
 	int get_member_offset(AST* parent, const std::string& member) {
 		TypeNode* type = get_expression_type(parent);
-		return target->get_class(type->root_type).get_offset(member);
+		return get_class(type->root_type).get_offset(member);
 	}
 	
 	void visit_value(AST* a) {
 		switch (a->kind) {
 			case AST::A_FLO: {
 				double f = std::stod(((FloatNode*)a)->number);
-				emit(make_addr(), {OP_LOAD_CONST, add_const(STACK_VALUE::make_double(f))});
+				emit({OP_LOAD_CONST, add_const(STACK_VALUE::make_double(f))});
 				return;
 			}
 			case AST::A_INT: {
 				int i = std::stoi(((IntegerNode*)a)->number);
-				emit(make_addr(), {OP_LOAD_CONST, add_const(STACK_VALUE::make_int(i))});
+				emit({OP_LOAD_CONST, add_const(STACK_VALUE::make_int(i))});
 				return ;
 			}
 			case AST::A_STRING: {
 				std::string s = ((StringNode*)a)->str;
-				emit(make_addr(), {OP_LOAD_CONST, add_const(STACK_VALUE::make_str(s))});
+				emit({OP_LOAD_CONST, add_const(STACK_VALUE::make_str(s))});
 				return;
 			}
-			case AST::A_TRUE:  emit(make_addr(), {OP_LOAD_TRUE}); return;
-			case AST::A_FALSE: emit(make_addr(), {OP_LOAD_FALSE}); return;
-			case AST::A_NULL:  emit(make_addr(), {OP_LOAD_NULL}); return;
+			case AST::A_TRUE:  emit({OP_LOAD_TRUE}); return;
+			case AST::A_FALSE: emit({OP_LOAD_FALSE}); return;
+			case AST::A_NULL:  emit({OP_LOAD_NULL}); return;
 			case AST::A_ARRAY: {
 				auto elems = ((ArrayNode*)a)->elements;
-				emit(make_addr(), {OP_NEW_ARRAY, (int)elems.size()});
+				emit({OP_NEW_ARRAY, (int)elems.size()});
 				for (size_t i = 0; i < elems.size(); ++i) {
-					emit(make_addr(), {OP_DUP});
-					emit(make_addr(), {OP_LOAD_IMMEDIATLY, (int)i});
+					emit({OP_DUP});
+					emit({OP_LOAD_IMMEDIATLY, (int)i});
 					visit_value(elems[i]);
-					emit(make_addr(), {OP_SET_ELEMENT});
+					emit({OP_SET_ELEMENT});
 				}
 				return ;
 			}
@@ -417,14 +1053,14 @@ private:
 			case AST::A_MEMBER_ACCESS: {
 				TypeNode* t = visit_member_access(a);
 				if (t->root_type == "int" || t->root_type == "float" || t->root_type == "bool")
-					emit(make_addr(), {OP_COPY});
+					emit({OP_COPY});
 				return ;
 			}
 			case AST::A_ELEMENT_GET: {
 				visit_element_get_node((ElementGetNode*)a);
 				TypeNode* elem_type = get_expression_type(a);
 				if (elem_type->root_type == "int" || elem_type->root_type == "float" || elem_type->root_type == "bool")
-					emit(make_addr(), {OP_COPY});
+					emit({OP_COPY});
 				return ;
 			}
 			case AST::A_CALL:
@@ -459,25 +1095,21 @@ private:
 	
 	void visit_mem_malloc(MemoryMallocNode* node) {
 		std::string class_name = node->name;
-		int size = target->object_size_record[class_name].info.size();
-		emit(make_addr(), {OP_NEW_OBJECT, size});
+		emit({OP_NEW_INSTANCE, class_shape_id(class_name)});
 		
 		if (node->is_call_c) {
 			std::string constructor_name = class_name + "$constructor";
-			int func_id = target->find_function_by_name(constructor_name);
-			emit(make_addr(), {OP_DUP});
+			int func_id = find_function(constructor_name);
+			emit({OP_DUP});
 			for (auto arg : node->args) {
 				visit_value(arg);
 			}
-			emit(make_addr(), {OP_CALL, func_id});
+			emit({OP_CALL, func_id});
 		}
 	}
 	
-	bool func_is_exist(std::string name) {
-		for (auto i : target->funcs)
-			if (i->func_name == name)
-				return true;
-		return false;
+	bool func_is_exist(const std::string& name) {
+		return find_function(name) != -1;
 	}
 	
 	void visit_call_node(CallNode* node) {
@@ -487,12 +1119,12 @@ private:
 			if (var_is_exist(name) && get_var(name).type->root_type == "lambda") {
 				for (auto arg : node->args) visit_value(arg);
 				load_name(name);
-				emit(make_addr(), {OP_SPECIAL_CALL});
+				emit({OP_SPECIAL_CALL});
 				return;
 			}
 			for (auto arg : node->args) visit_value(arg);
-			int id = (name != code_tmp.current_func_name) ? target->find_function_by_name(name) : code_tmp.id;
-			emit(make_addr(), {OP_CALL, id});
+			int id = (name != code_tmp.current_func_name) ? find_function(name) : code_tmp.id;
+			emit({OP_CALL, id});
 		}
 		else if (func->kind == AST::A_MEMBER_ACCESS) {
 			auto ma = (MemberAccessNode*)func;
@@ -501,27 +1133,35 @@ private:
 			if (parent_type->__kind == TypeNode::TK_MODULE) {
 				for (auto arg : node->args) visit_value(arg);
 				visit_member_access(ma->parent);
-				emit(make_addr(), {OP_LOAD_MODULE_METHOD, add_const(STACK_VALUE::make_str(ma->member))});
-				emit(make_addr(), {OP_SPECIAL_CALL});
+				emit({OP_LOAD_MODULE_METHOD, add_const(STACK_VALUE::make_str(ma->member))});
+				emit({OP_SPECIAL_CALL});
 				return;
 			}
-			else if (!func_is_exist(ma->member) && get_member_class(ma)->root_type == "lambda") {
+			ObjectInfo* cls = find_class(parent_type->root_type);
+			bool is_object = (cls != nullptr);
+			if (is_object && cls->var_is_exist(ma->member)
+			    && cls->get_var_info(ma->member).type->root_type == "lambda") {
 				for (auto arg : node->args) visit_value(arg);
 				visit_member_access(ma);
-				emit(make_addr(), {OP_SPECIAL_CALL});
+				emit({OP_SPECIAL_CALL});
 				return;
 			}
+			else if (is_object && (cls->has_method(ma->member) || !func_is_exist(ma->member))) {
+				visit_member_access(ma->parent);
+				for (auto arg : node->args) visit_value(arg);
+				emit({OP_INVOKE, add_const(STACK_VALUE::make_str(ma->member)), (int)node->args.size()});
+			}
 			else {
 				visit_member_access(ma->parent);
 				for (auto arg : node->args) visit_value(arg);
-				int id = (code_tmp.current_func_name != ma->member) ? target->find_function_by_name(ma->member) : code_tmp.id;
-				emit(make_addr(), {OP_CALL, id});
+				int id = (code_tmp.current_func_name != ma->member) ? find_function(ma->member) : code_tmp.id;
+				emit({OP_CALL, id});
 			}
 		}
 		else if (func->kind == AST::A_ELEMENT_GET) {
 			for (auto arg : node->args) visit_value(arg);
 			visit_element_get_node((ElementGetNode*)func);
-			emit(make_addr(), {OP_SPECIAL_CALL});
+			emit({OP_SPECIAL_CALL});
 		}
 		else {
 			throw std::exception();
@@ -530,19 +1170,19 @@ private:
 	
 	void visit_bit_not_node(AST* node) {
 		visit_value(((BitNotNode*)node)->expr);
-		emit(make_addr(), {OP_BIT_NOT});
+		emit({OP_BIT_NOT});
 	}
 	
 	TypeNode* visit_element_get_node(ElementGetNode* node) {
 		visit_member_access(node->array_name);
 		visit_value(node->position);
-		emit(make_addr(), {OP_GET_ELEMENT});
+		emit({OP_GET_ELEMENT});
 		return get_expression_type(node);
 	}
 	
 	void visit_not_node(AST* node) {
 		visit_value(((NotNode*)node)->expr);
-		emit(make_addr(), {OP_NOT});
+		emit({OP_NOT});
 	}
 	
 	void visit_array_node(AST* node) { visit_value(node); }
@@ -553,17 +1193,17 @@ private:
 		int is_pre = self->ipre;
 		if (tmp_target->kind == AST::A_ID) {
 			load_name(((IdNode*)tmp_target)->id);
-			emit(make_addr(), {OP_LOAD_IMMEDIATLY, 1});
-			emit(make_addr(), {OP_ADD});
+			emit({OP_LOAD_IMMEDIATLY, 1});
+			emit({OP_ADD});
 			set_name(((IdNode*)tmp_target)->id);
 		}
 		else if (tmp_target->kind == AST::A_MEMBER_ACCESS) {
 			visit_member_access(((MemberAccessNode*)tmp_target)->parent);
 			visit_member_access(tmp_target);
-			emit(make_addr(), {OP_LOAD_IMMEDIATLY, 1});
-			emit(make_addr(), {OP_ADD});
-			emit(make_addr(), {OP_MEMBER_SET, get_member_offset(tmp_target)});
-			emit(make_addr(), {OP_POP});
+			emit({OP_LOAD_IMMEDIATLY, 1});
+			emit({OP_ADD});
+			emit({OP_MEMBER_SET, get_member_offset(tmp_target)});
+			emit({OP_POP});
 		}
 		else if (tmp_target->kind == AST::A_ELEMENT_GET) {
 			auto a = (ElementGetNode*) tmp_target;
@@ -572,9 +1212,9 @@ private:
 			visit_member_access(obj);
 			visit_value(pos);
 			visit_element_get_node(a);
-			emit(make_addr(), {OP_LOAD_IMMEDIATLY, 1});
-			emit(make_addr(), {OP_ADD});
-			emit(make_addr(), {OP_SET_ELEMENT});
+			emit({OP_LOAD_IMMEDIATLY, 1});
+			emit({OP_ADD});
+			emit({OP_SET_ELEMENT});
 		}
 		else {
 			printf("Unsupported target for self increment\n");
@@ -588,8 +1228,8 @@ private:
 		int is_pre = self->ipre;
 		if (tmp_target->kind == AST::A_ID) {
 			load_name(((IdNode*)tmp_target)->id);
-			emit(make_addr(), {OP_LOAD_IMMEDIATLY, 1});
-			emit(make_addr(), {OP_SUB});
+			emit({OP_LOAD_IMMEDIATLY, 1});
+			emit({OP_SUB});
 			set_name(((IdNode*)tmp_target)->id);
 		}
 		else if (tmp_target->kind == AST::A_MEMBER_ACCESS) {
@@ -597,9 +1237,9 @@ private:
 			auto parent = ((MemberAccessNode*) tmp_target)->parent;
 			visit_member_access(parent);
 			visit_member_access(tmp_target);
-			emit(make_addr(), {OP_LOAD_IMMEDIATLY, 1});
-			emit(make_addr(), {OP_SUB});
-			emit(make_addr(), {OP_MEMBER_SET, get_member_offset(tmp_target)});
+			emit({OP_LOAD_IMMEDIATLY, 1});
+			emit({OP_SUB});
+			emit({OP_MEMBER_SET, get_member_offset(tmp_target)});
 		}
 		else if (tmp_target->kind == AST::A_ELEMENT_GET) {
 			auto a = (ElementGetNode*) tmp_target;
@@ -608,9 +1248,9 @@ private:
 			visit_member_access(obj);
 			visit_value(pos);
 			visit_element_get_node(a);
-			emit(make_addr(), {OP_LOAD_IMMEDIATLY, 1});
-			emit(make_addr(), {OP_SUB});
-			emit(make_addr(), {OP_SET_ELEMENT});
+			emit({OP_LOAD_IMMEDIATLY, 1});
+			emit({OP_SUB});
+			emit({OP_SET_ELEMENT});
 		}
 		else {
 			printf("Unsupported target for self increment\n");
@@ -698,7 +1338,7 @@ private:
 		mg->add(name, path);
 	}
 	
-	void visit_all(AST* node, std::string begin, std::string end) {
+	void visit_all(AST* node, int begin, int end) {
 		switch (node->kind) {
 			case AST::A_IF:        visit_if_node((IfNode*)node, begin, end); break;
 			case AST::A_BLOCK:     visit_block((Block*)node, begin, end); break;
@@ -724,7 +1364,7 @@ private:
 			case AST::A_SELF_OPERA: visit_self_opera_node(node); break;
 			case AST::A_MEM_MALLOC: visit_mem_malloc((MemoryMallocNode*)node); break;
 			case AST::A_LAMBDA:    visit_lambda_node((LambdaNode*)node); break;
-			case AST::A_NULL:      emit(make_addr(), {OP_LOAD_NULL}); break;
+			case AST::A_NULL:      emit({OP_LOAD_NULL}); break;
 			case AST::A_IMPORT:    visit_import_node(node); break;
 			default:
 				printf("Unknown AST kind: %d\n", node->kind);
@@ -736,23 +1376,23 @@ private:
 		visit_value(node->left);
 		visit_value(node->right);
 		std::string op = node->op;
-		if (op == "+")  emit(make_addr(), {OP_ADD});
-		else if (op == "-") emit(make_addr(), {OP_SUB});
-		else if (op == "*") emit(make_addr(), {OP_MUL});
-		else if (op == "/") emit(make_addr(), {OP_DIV});
-		else if (op == "%") emit(make_addr(), {OP_MOD});
-		else if (op == "<<") emit(make_addr(), {OP_LEFT});
-		else if (op == ">>") emit(make_addr(), {OP_RIGHT});
-		else if (op == "&") emit(make_addr(), {OP_BIT_AND});
-		else if (op == "|") emit(make_addr(), {OP_BIT_OR});
-		else if (op == "&&") emit(make_addr(), {OP_AND});
-		else if (op == "||") emit(make_addr(), {OP_OR});
-		else if (op == ">") emit(make_addr(), {OP_GT});
-		else if (op == ">=") emit(make_addr(), {OP_GE});
-		else if (op == "<") emit(make_addr(), {OP_LT});
-		else if (op == "<=") emit(make_addr(), {OP_LE});
-		else if (op == "==") emit(make_addr(), {OP_EQ});
-		else if (op == "!=") emit(make_addr(), {OP_NE});
+		if (op == "+")  emit({OP_ADD});
+		else if (op == "-") emit({OP_SUB});
+		else if (op == "*") emit({OP_MUL});
+		else if (op == "/") emit({OP_DIV});
+		else if (op == "%") emit({OP_MOD});
+		else if (op == "<<") emit({OP_LEFT});
+		else if (op == ">>") emit({OP_RIGHT});
+		else if (op == "&") emit({OP_BIT_AND});
+		else if (op == "|") emit({OP_BIT_OR});
+		else if (op == "&&") emit({OP_AND});
+		else if (op == "||") emit({OP_OR});
+		else if (op == ">") emit({OP_GT});
+		else if (op == ">=") emit({OP_GE});
+		else if (op == "<") emit({OP_LT});
+		else if (op == "<=") emit({OP_LE});
+		else if (op == "==") emit({OP_EQ});
+		else if (op == "!=") emit({OP_NE});
 		else {
 			std::cout << "unknown operator: " << op << std::endl;
 			exit(-1);
@@ -760,7 +1400,7 @@ private:
 	}
 	
 	inline int get_member_offset(AST* node) {
-		return target->get_class(get_member_class(((MemberAccessNode*)node)->parent)->root_type)
+		return get_class(get_member_class(((MemberAccessNode*)node)->parent)->root_type)
 			.get_offset(((MemberAccessNode*) node)->member);
 	}
 	
@@ -771,7 +1411,7 @@ private:
 		if (node->kind == AST::A_MEMBER_ACCESS) {
 			auto ma = (MemberAccessNode*)node;
 			TypeNode* parent_type = get_member_class(ma->parent);
-			return target->get_class(parent_type->root_type).get_var_info(ma->member).type;
+			return get_class(parent_type->root_type).get_var_info(ma->member).type;
 		} else if (node->kind == AST::A_ID) {
 			return get_var(((IdNode*)node)->id).type;
 		}
@@ -786,16 +1426,16 @@ private:
 			auto ma = (MemberAccessNode*)node;
 			TypeNode* parent_type = visit_member_access(ma->parent);
 			if (parent_type->__kind != TypeNode::TK_MODULE) {
-				auto obj_info = target->get_class(parent_type->root_type);
-				auto var_info = obj_info.get_var_info(ma->member);
+				const ObjectInfo& obj_info = get_class(parent_type->root_type);
+				const VarInfo& var_info = obj_info.get_var_info(ma->member);
 				if (current_class != parent_type->root_type && var_info.as == ObjectNode::PRIVATE && var_info.origin_class != current_class) {
 					std::cout << "Name '" << ma->member << "' is not a public member\n";
 					exit(-1);
 				}
-				emit(make_addr(), {OP_MEMBER_GET, obj_info.get_offset(ma->member)});
+				emit({OP_MEMBER_GET, obj_info.get_offset(ma->member)});
 				return var_info.type;
 			} else {
-				emit(make_addr(), {OP_LOAD_MODULE_METHOD, add_const(STACK_VALUE::make_str(ma->member))});
+				emit({OP_LOAD_MODULE_METHOD, add_const(STACK_VALUE::make_str(ma->member))});
 				TypeNode *tn = new TypeNode("func");
 				tn->__kind = TypeNode::TK_FUNCTION;
 				return tn;
@@ -803,7 +1443,7 @@ private:
 		} else if (node->kind == AST::A_ID) {
 			if (mg->exist(((IdNode*)node)->id)) {
 				std::string name = ((IdNode*)node)->id;
-				emit(make_addr(), {OP_LOAD_CONST, add_const(STACK_VALUE::make_str(name))});
+				emit({OP_LOAD_CONST, add_const(STACK_VALUE::make_str(name))});
 				return new TypeNode(mg->get_path(name), name);
 			}
 			load_name(((IdNode*)node)->id);
@@ -812,55 +1452,55 @@ private:
 		throw std::exception();
 	}
 	
-	void visit_if_node(IfNode* node, std::string begin, std::string end) {
+	void visit_if_node(IfNode* node, int begin, int end) {
 		create_scope();
-		std::string if_else = make_addr(), if_end = make_addr();
+		int if_else = new_label(), if_end = new_label();
 		visit_value(node->condition);
-		emit(make_addr(), {OP_JUMP_IF_FALSE, if_else});
+		emit_jump(OP_JUMP_IF_FALSE, if_else);
 		visit_block(node->if_true, begin, end);
-		emit(make_addr(), {OP_JUMP, if_end});
-		emit(if_else, {OP_NOP});
+		emit_jump(OP_JUMP, if_end);
+		place(if_else);
 		if (node->if_false) visit_block(node->if_false, begin, end);
-		emit(if_end, {OP_NOP});
+		place(if_end);
 		leave_scope();
 	}
 	
 	void visit_while_node(WhileNode* node) {
 		create_scope();
-		std::string lp_begin = make_addr(), lp_exit = make_addr();
-		emit(lp_begin, {OP_NOP});
+		int lp_begin = new_label(), lp_exit = new_label();
+		place(lp_begin);
 		visit_value(node->condition);
-		emit(make_addr(), {OP_JUMP_IF_FALSE, lp_exit});
+		emit_jump(OP_JUMP_IF_FALSE, lp_exit);
 		visit_block(node->body, lp_begin, lp_exit);
-		emit(make_addr(), {OP_JUMP, lp_begin});
-		emit(lp_exit, {OP_NOP});
+		emit_jump(OP_JUMP, lp_begin);
+		place(lp_exit);
 		leave_scope();
 	}
 	
 	void visit_for_node(ForNode* node) {
 		create_scope();
-		std::string loop_start = make_addr(), loop_exit = make_addr(), cont = make_addr();
+		int loop_start = new_label(), loop_exit = new_label(), cont = new_label();
 		if (node->init) {
 			if (node->init->kind == AST::A_VAR_DEF)
 				visit_var_define((VarDefineNode*)node->init);
 			else {
 				visit_value(node->init);
-				emit(make_addr(), {OP_POP});
+				emit({OP_POP});
 			}
 		}
-		emit(loop_start, {OP_NOP});
+		place(loop_start);
 		if (node->is_continue) {
 			visit_value(node->is_continue);
-			emit(make_addr(), {OP_JUMP_IF_FALSE, loop_exit});
+			emit_jump(OP_JUMP_IF_FALSE, loop_exit);
 		}
 		visit_block(node->body, cont, loop_exit);
-		emit(cont, {OP_NOP});
+		place(cont);
 		if (node->change) {
 			visit_value(node->change);
-			emit(make_addr(), {OP_POP});
+			emit({OP_POP});
 		}
-		emit(make_addr(), {OP_JUMP, loop_start});
-		emit(loop_exit, {OP_NOP});
+		emit_jump(OP_JUMP, loop_start);
+		place(loop_exit);
 		leave_scope();
 	}
 	
@@ -892,29 +1532,29 @@ private:
 			} else if (id->kind == AST::A_MEMBER_ACCESS) {
 				visit_value(((MemberAccessNode*) id)->parent);
 				visit_value(val);
-				emit(make_addr(), {OP_MEMBER_SET, get_member_offset(id)});
+				emit({OP_MEMBER_SET, get_member_offset(id)});
 				return;
 			} else if (id->kind == AST::A_ELEMENT_GET) {
 				auto a = (ElementGetNode*) id;
 				visit_member_access(a->array_name);
 				visit_value(a->position);
 				visit_value(sp->value);
-				emit(make_addr(), {OP_SET_ELEMENT});
+				emit({OP_SET_ELEMENT});
 				return;
 			}
 		} else {
 			if (id->kind == AST::A_ID) {
 				load_name(((IdNode*) id)->id);
 				visit_value(val);
-				emit(make_addr(), {arith_op});
+				emit({arith_op});
 				set_name(((IdNode*) id)->id);
 				return;
 			} else if (id->kind == AST::A_MEMBER_ACCESS) {
 				visit_value(((MemberAccessNode*) id)->parent);
 				visit_member_access(id);
 				visit_value(val);
-				emit(make_addr(), {arith_op});
-				emit(make_addr(), {OP_MEMBER_SET, get_member_offset(id)});
+				emit({arith_op});
+				emit({OP_MEMBER_SET, get_member_offset(id)});
 				return;
 			} else if (id->kind == AST::A_ELEMENT_GET) {
 				auto a = (ElementGetNode*) id;
@@ -922,48 +1562,48 @@ private:
 				visit_value(a->position);
 				visit_element_get_node(a);
 				visit_value(sp->value);
-				emit(make_addr(), {arith_op});
-				emit(make_addr(), {OP_SET_ELEMENT});
+				emit({arith_op});
+				emit({OP_SET_ELEMENT});
 				return;
 			}
 		}
 	}
 	
 	void visit_func_node(FunctionNode* node) {
-		code_tmp.code_cache.clear();
+		TimeReport::FunctionScope timing(node->name);
+		code_tmp.label_addr.clear();
+		code_tmp.patches.clear();
 		create_scope();
 		code_tmp.current = new Chunk;
-		code_tmp.id = target->get_cnt();
+		code_tmp.id = next_function_id();
 		code_tmp.current_func_name = node->name;
-		bool is_constructor = (node->name.find("$constructor") != std::string::npos);
+		bool is_constructor = (node->name.str().find("$constructor") != std::string::npos);
 		bool is_method = (!current_class.empty() && !is_constructor);
 		
 		if (is_constructor || is_method) {
 			int this_id = code_tmp.current->add_name("this");
 			add_var("this", this_id, make_type(current_class));
-			emit(make_addr(), {OP_SET_NAME, this_id});
+			emit({OP_SET_NAME, this_id});
 		}
 		
 		for (auto& arg : node->args) {
 			auto vd = (VarDefineNode*)arg;
 			int id = code_tmp.current->add_name(vd->name);
 			add_var(vd->name, id, vd->type);
-			emit(make_addr(), {OP_SET_NAME, id});
+			emit({OP_SET_NAME, id});
 		}
 		
 		if (code_tmp.current_func_name == "main") {
 			for (auto i : mg->modules) {
-				emit(
-					make_addr(), {OP_LOAD_MODULE,
-					              add_const(STACK_VALUE::make_str(i.second.path)),
-					              add_const(STACK_VALUE::make_str(i.first))}
-				);
+				emit({OP_LOAD_MODULE,
+				      add_const(STACK_VALUE::make_str(i.second.path)),
+				      add_const(STACK_VALUE::make_str(i.first))});
 			}
 		}
 		
 		code_tmp.arg_size = node->args.size() + (is_constructor || is_method ? 1 : 0);
-		visit_block(node->body, "", "");
-		emit(make_addr(), {OP_LEAVE});
+		visit_block(node->body, -1, -1);
+		emit({OP_LEAVE});
 		emit_function(false);
 		leave_scope();
 	}
@@ -971,37 +1611,37 @@ private:
 	int lambda_count = 0;
 	
 	inline std::string make_l_name() {
+		if (job) return "lambda_" + std::to_string(job->first_lambda + job->used_lambdas++);
 		return "lambda_" + std::to_string(lambda_count++);
 	}
 	
 	void visit_switch_node(SwitchNode* node) {
-		std::string begin_ = make_addr(), end_ = make_addr();
-		emit(begin_, {OP_NOP});
+		int begin_ = new_label(), end_ = new_label();
+		place(begin_);
 		visit_value(node->target_value);
 		for (auto i : node->units) {
 			if (!i->is_default) {
-				emit(make_addr(), {OP_DUP});
+				emit({OP_DUP});
 				visit_value(i->value);
-				emit(make_addr(), {OP_EQ});
-				std::string not_eq_ = make_addr();
-				emit(make_addr(), {OP_JUMP_IF_FALSE, not_eq_});
+				emit({OP_EQ});
+				int not_eq_ = new_label();
+				emit_jump(OP_JUMP_IF_FALSE, not_eq_);
 				visit_block(i->stmt, begin_, end_);
-				emit(not_eq_, {OP_NOP});
+				place(not_eq_);
 			} else {
 				visit_block(i->stmt, begin_, end_);
 			}
 		}
-		emit(end_, {OP_NOP});
+		place(end_);
 	}
 	
 	void visit_lambda_node(LambdaNode* node) {
 		auto lb_node = (LambdaNode*) node;
 		auto args_list = lb_node->args;
 		auto body = lb_node->body;
-		Tmp tmp_codet = code_tmp;
-		create_scope();
+		Tmp saved = std::move(code_tmp);
 		code_tmp = Tmp();
-		code_tmp.id = target->get_cnt();
+		code_tmp.id = next_function_id();
 		std::string name = make_l_name();
 		code_tmp.current_func_name = name;
 		code_tmp.arg_size = node->args.size();
@@ -1009,14 +1649,13 @@ private:
 			auto vd = (VarDefineNode*)arg;
 			int id = code_tmp.current->add_name(vd->name);
 			add_var(vd->name, id, vd->type);
-			emit(make_addr(), {OP_SET_NAME, id});
+			emit({OP_SET_NAME, id});
 		}
-		visit_block(body, "", "");
-		emit(make_addr(), { OP_LEAVE });
+		visit_block(body, -1, -1);
+		emit({ OP_LEAVE });
 		int id = emit_function(true);
-		leave_scope();
-		code_tmp = tmp_codet;
-		emit(make_addr(), {OP_LOAD_FUNC_ADDR, id});
+		code_tmp = std::move(saved);
+		emit({OP_LOAD_FUNC_ADDR, id});
 	}
 	
 	void visit_var_define(VarDefineNode* node) {
@@ -1024,17 +1663,26 @@ private:
 		add_var(node->name, id, node->type);
 		if (node->init_value) {
 			visit_value(node->init_value);
-			emit(make_addr(), {OP_SET_NAME, id});
+			emit({OP_SET_NAME, id});
 		}
 	}
 	
-	void add_object(std::string name, std::vector<VarInfo> infos, std::vector<ObjectInfo*> ext_class) {
-		target->regist_class(name, infos, ext_class);
+	void add_object(std::string name, std::vector<VarInfo> infos, std::vector<ObjectInfo*> ext_class,
+	                std::vector<std::string> methods) {
+		target->regist_class(name, infos, ext_class, methods);
 	}
 	
 	void visit_class_node(ObjectNode* node) {
-		std::vector<VarInfo> infos;
 		current_class = node->name;
+		for (auto fn : declare_class(node))
+			visit_func_node(fn);
+		current_class = "";
+	}
+	
+	// Registers the class and names its methods; returns them for compiling.
+	std::vector<FunctionNode*> declare_class(ObjectNode* node) {
+		std::vector<VarInfo> infos;
+		std::unordered_set<std::string> declared;
 		std::vector<ObjectInfo*> base_infos;
 		for (auto& base_name : node->extern_class) {
 			if (target->object_size_record.find(base_name) == target->object_size_record.end()) {
@@ -1044,11 +1692,9 @@ private:
 			ObjectInfo& base_info = target->object_size_record[base_name];
 			base_infos.push_back(&base_info);
 			for (auto& var : base_info.info) {
-				for (auto& existing : infos) {
-					if (existing.name == var.name) {
-						std::cout << "Member '" << var.name << "' conflicts with base class member\n";
-						exit(-1);
-					}
+				if (!declared.insert(var.name).second) {
+					std::cout << "Member '" << var.name << "' conflicts with base class member\n";
+					exit(-1);
 				}
 				infos.push_back({var.name, var.type, var.as, base_name});
 			}
@@ -1056,46 +1702,49 @@ private:
 		for (auto& p : node->members) {
 			if (p.second->kind == AST::A_VAR_DEF) {
 				auto vd = (VarDefineNode*)p.second;
-				for (auto& existing : infos) {
-					if (existing.name == vd->name) {
-						std::cout << "Member '" << vd->name << "' conflicts with base class member\n";
-						exit(-1);
-					}
+				if (!declared.insert(vd->name).second) {
+					std::cout << "Member '" << vd->name << "' conflicts with base class member\n";
+					exit(-1);
 				}
 				infos.push_back({vd->name, vd->type, node->as[vd->name], node->name});
 			}
 		}
-		add_object(node->name, infos, base_infos);
+		std::vector<std::string> methods;
+		for (auto& p : node->members)
+			if (p.second->kind == AST::A_FUNC_DEFINE && p.first != "constructor")
+				methods.push_back(p.first);
+		add_object(node->name, infos, base_infos, methods);
+		std::vector<FunctionNode*> fns;
 		for (auto& p : node->members) {
 			if (p.second->kind == AST::A_FUNC_DEFINE) {
 				auto fn = (FunctionNode*)p.second;
 				if (fn->name == "constructor")
 					fn->name = node->name + "$constructor";
 				else fn->name = node->name + "$" + fn->name;
-				visit_func_node(fn);
+				fns.push_back(fn);
 			}
 		}
-		current_class = "";
+		return fns;
 	}
 	
-	void visit_continue(std::string begin, std::string) {
-		emit(make_addr(), {OP_JUMP, begin});
+	void visit_continue(int begin, int) {
+		emit_jump(OP_JUMP, begin);
 	}
 	
-	void visit_break(std::string, std::string end) {
-		emit(make_addr(), {OP_JUMP, end});
+	void visit_break(int, int end) {
+		emit_jump(OP_JUMP, end);
 	}
 	
 	void visit_return(ReturnNode* node) {
 		if (node->value) {
 			visit_value(node->value);
-			emit(make_addr(), {OP_RETURN});
+			emit({OP_RETURN});
 		} else {
-			emit(make_addr(), {OP_LEAVE});
+			emit({OP_LEAVE});
 		}
 	}
 	
-	void visit_block(Block* node, std::string begin, std::string end) {
+	void visit_block(Block* node, int begin, int end) {
 		for (auto stmt : node->codes)
 			visit_all(stmt, begin, end);
 	}
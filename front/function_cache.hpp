@@ -0,0 +1,171 @@
+#ifndef COPL_FUNCTION_CACHE_HPP
+#define COPL_FUNCTION_CACHE_HPP
+
+#include "../running/value.hpp"
+#include "../running/program_loader.hpp"
+#include "../running/program_writer.hpp"
+#include "../resfile_types.hpp"
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Bump when the code generated for unchanged input changes.
+#define FUNCTION_CACHE_VERSION 2
+
+// FNV-1a over everything a compiled function depends on.
+struct Fingerprint {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    void add(const void* data, size_t len) {
+        for (size_t i = 0; i < len; ++i) {
+            h ^= ((const unsigned char*)data)[i];
+            h *= 0x100000001b3ULL;
+        }
+    }
+
+    void add(std::string_view s) {
+        add((int64_t)s.size());
+        add(s.data(), s.size());
+    }
+
+    void add(const std::string& s) { add(std::string_view(s)); }
+
+    void add(int64_t v) { add(&v, sizeof(v)); }
+};
+
+// Compiled top-level functions of one source, kept from the last build and
+// keyed by fingerprint, see Compiler::fingerprint. Each entry is one
+// function or method with the lambdas it contains, in the int form code
+// takes before Chunk::encode. Function ids and class shape ids in it are
+// the ones of the build that produced it; `func_refs` and `shape_refs` name
+// what the ids outside the entry's own range stood for, so it can be
+// relocated into a program where its neighbours moved.
+struct FunctionCache {
+    struct Func {
+        std::string name;
+        bool is_lambda = false;
+        int id = 0, args_len = 0;
+        std::vector<int> ops;
+        std::vector<std::string> names;
+        std::vector<STACK_VALUE*> consts;
+    };
+
+    struct Entry {
+        std::vector<Func> funcs;
+        int first_id = 0, first_lambda = 0, ids = 0, lambdas = 0;
+        std::vector<std::pair<int, std::string>> func_refs, shape_refs;
+    };
+
+    // From the previous build; only read while compiling.
+    std::unordered_map<uint64_t, Entry> entries;
+    // Written by this build, what the next one will find.
+    std::unordered_map<uint64_t, Entry> fresh;
+    size_t reused = 0, compiled = 0;
+
+    const Entry* find(uint64_t print) const {
+        auto it = entries.find(print);
+        return it == entries.end() ? nullptr : &it->second;
+    }
+
+    // Anything unreadable, damaged or from another version just leaves the
+    // cache empty. The file ends with a fingerprint of everything before it,
+    // and counts are checked against what is left, so neither a torn write
+    // nor stray bytes can send the reader off the end.
+    void parse(std::string& data) {
+        entries.clear();
+        if (data.size() < 3 * sizeof(uint32_t) + sizeof(uint64_t))
+            return;
+        size_t body = data.size() - sizeof(uint64_t);
+        Fingerprint check;
+        check.add(data.data(), body);
+        uint64_t stored;
+        memcpy(&stored, &data[body], sizeof(stored));
+        if (stored != check.h)
+            return;
+        ByteReader in { &data[0], &data[0] + body, true, true };
+        if (in.read<uint32_t>() != COPL_MAGIC || in.read<uint32_t>() != COPL_VERSION
+            || in.read<uint32_t>() != FUNCTION_CACHE_VERSION)
+            return;
+        uint32_t count = in.bounded_count();
+        for (uint32_t i = 0; i < count && !in.failed; ++i) {
+            uint64_t print = in.read<uint64_t>();
+            Entry& e = entries[print];
+            e.first_id = in.sint();
+            e.first_lambda = in.sint();
+            e.ids = in.sint();
+            e.lambdas = in.sint();
+            e.funcs.resize(in.bounded_count());
+            for (auto& f : e.funcs) {
+                f.name = in.read_string();
+                f.is_lambda = in.read<uint8_t>() != 0;
+                f.id = in.sint();
+                f.args_len = in.sint();
+                f.ops.resize(in.bounded_count());
+                for (auto& op : f.ops)
+                    op = in.sint();
+                f.names.resize(in.bounded_count());
+                for (auto& n : f.names)
+                    n = in.read_string();
+                f.consts.resize(in.bounded_count());
+                for (auto& c : f.consts)
+                    c = read_value(in);
+            }
+            for (auto refs : {&e.func_refs, &e.shape_refs}) {
+                refs->resize(in.bounded_count());
+                for (auto& r : *refs) {
+                    r.first = in.sint();
+                    r.second = in.read_string();
+                }
+            }
+        }
+        if (in.failed)
+            entries.clear();
+    }
+
+    CodeBuffer serialize() const {
+        CodeBuffer out;
+        write_u32(out, COPL_MAGIC);
+        write_u32(out, COPL_VERSION);
+        write_u32(out, FUNCTION_CACHE_VERSION);
+        write_varint(out, fresh.size());
+        for (auto& p : fresh) {
+            const Entry& e = p.second;
+            write_bytes(out, &p.first, sizeof(p.first));
+            for (int v : {e.first_id, e.first_lambda, e.ids, e.lambdas})
+                write_varint(out, zigzag(v));
+            write_varint(out, e.funcs.size());
+            for (auto& f : e.funcs) {
+                write_string(out, f.name);
+                out.push_back(f.is_lambda ? 1 : 0);
+                write_varint(out, zigzag(f.id));
+                write_varint(out, zigzag(f.args_len));
+                write_varint(out, f.ops.size());
+                for (int op : f.ops)
+                    write_varint(out, zigzag(op));
+                write_varint(out, f.names.size());
+                for (auto& n : f.names)
+                    write_string(out, n);
+                write_varint(out, f.consts.size());
+                for (auto c : f.consts)
+                    write_value(out, c);
+            }
+            for (auto refs : {&e.func_refs, &e.shape_refs}) {
+                write_varint(out, refs->size());
+                for (auto& r : *refs) {
+                    write_varint(out, zigzag(r.first));
+                    write_string(out, r.second);
+                }
+            }
+        }
+        Fingerprint check;
+        check.add(out.data(), out.size());
+        write_bytes(out, &check.h, sizeof(check.h));
+        return out;
+    }
+};
+
+#endif
@@ -3,6 +3,12 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
 
 struct Position {
     int lin, col;
@@ -13,24 +19,33 @@ struct Position {
 
     Position() { lin = 0; col = 0; }
 
-    std::string debug() {
+    std::string debug() const {
         return "[" + std::to_string(lin) + ", " + std::to_string(col) + "]";
     }
 };
 
+// A token is a slice of the source it was lexed from; the text is only
+// copied out when the parser builds a node from it. For a string literal the
+// slice is the raw text between the quotes, see decode_string().
 struct Token {
-    std::string data;
-    enum TokenKind { TT_INTEGER, TT_FLOAT, TT_STRING, TT_ID, TT_OP, TT_BOOL, TT_KEY } kind;
+    enum TokenKind : uint8_t { TT_INTEGER, TT_FLOAT, TT_STRING, TT_ID, TT_OP, TT_BOOL, TT_KEY } kind;
+    uint32_t offset, length;
+    Position start_pos;
 
-    Position start_pos, end_pos;
+    Token() : kind(TT_OP), offset(0), length(0) {}
 
-    Token(std::string data, TokenKind kind, Position start_pos, Position end_pos) {
-        this->data = data;
+    Token(TokenKind kind, size_t offset, size_t length, Position start_pos) {
         this->kind = kind;
+        this->offset = (uint32_t)offset;
+        this->length = (uint32_t)length;
         this->start_pos = start_pos;
-        this->end_pos = end_pos;
     }
-    void debug() { std::cout << "('" << data << "', " << kind << "')" << start_pos.debug() << end_pos.debug(); }
+
+    std::string_view text(std::string_view source) const { return source.substr(offset, length); }
+
+    void debug(std::string_view source) const {
+        std::cout << "('" << text(source) << "', " << (int)kind << "')" << start_pos.debug();
+    }
 };
 
 const std::vector<std::string> keys = {
@@ -38,134 +53,228 @@ const std::vector<std::string> keys = {
         "import", "public", "private", "as", "switch", "case", "default"
 };
 
-class Lexer {
-public:
-    Lexer(std::string expr) {
-        this->expr = expr;
-        pos = -1;
-        lin = col = 1;
-        advance();
-        make_tokens();
+const std::vector<std::string> ops = {
+        "++", "--", "+=", "-=", "*=", "/=", "%=", ">>=", "<<=", ">>", "<<", "==", ">=", "<=", "!=", "**", "||", "&&", "|=", "&=", "->"
+};
+
+// Character classes, one table lookup per byte.
+enum CharClass : uint8_t { CC_DIGIT = 1, CC_ID_START = 2, CC_ID = 4, CC_SPACE = 8, CC_QUOTE = 16, CC_NEWLINE = 32 };
+
+struct CharTable {
+    uint8_t cls[256] = {};
+    constexpr CharTable() {
+        for (int c = '0'; c <= '9'; ++c) cls[c] = CC_DIGIT | CC_ID;
+        for (int c = 'a'; c <= 'z'; ++c) cls[c] = CC_ID_START | CC_ID;
+        for (int c = 'A'; c <= 'Z'; ++c) cls[c] = CC_ID_START | CC_ID;
+        cls['_'] = CC_ID_START | CC_ID;
+        cls[' '] = cls['\t'] = cls['\v'] = cls['\f'] = CC_SPACE;
+        cls['\n'] = cls['\r'] = CC_SPACE | CC_NEWLINE;
+        cls['\''] = cls['"'] = CC_QUOTE;
     }
+    bool is(char c, uint8_t mask) const { return cls[(unsigned char)c] & mask; }
+};
 
-    int lin, col;
-    std::vector<Token> tokens;
-    std::vector<std::string> ops = {
-            "++", "--", "+=", "-=", "*=", "/=", "%=", ">>=", "<<=", ">>", "<<", "==", ">=", "<=", "!=", "**", "||", "&&", "|=", "&=", "->"
-    };
-private:
-    int pos;
-    char current;
-    std::string expr;
-
-    inline Position make_pos() { return {lin, col}; }
-
-    void advance(int len = 1) {
-        pos += len;
-        current = 0;
-        ++col;
-        if (pos < expr.size()) {
-            current = expr[pos];
-            if (current == '\n' || current == '\r') {
-                ++lin;
-                col = 1;
-            }
+constexpr CharTable char_table;
+
+// Keywords and the two bool literals in a collision-free table indexed by
+// length, first and last character. A hit is confirmed with one compare.
+struct KeywordTable {
+    static const int SIZE = 32;
+    struct Slot { std::string word; Token::TokenKind kind; };
+    Slot slots[SIZE];
+
+    static unsigned hash(const char* s, size_t len) {
+        return (len + (unsigned char)s[0] * 9u + (unsigned char)s[len - 1] * 29u) & (SIZE - 1);
+    }
+
+    KeywordTable() {
+        for (auto& k : keys) add(k, Token::TT_KEY);
+        add("true", Token::TT_BOOL);
+        add("false", Token::TT_BOOL);
+    }
+
+    void add(const std::string& word, Token::TokenKind kind) {
+        Slot& s = slots[hash(word.data(), word.size())];
+        if (!s.word.empty()) {
+            printf("Internal error: keyword hash collision between '%s' and '%s'\n", s.word.c_str(), word.c_str());
+            exit(-1);
         }
+        s = {word, kind};
     }
 
-    bool back_comp(std::string data) {
-        if (pos + data.size() > expr.size())
-            return false;
-        for (int i = 0; i < data.size(); ++i)
-            if (expr[pos + i] != data[i])
-                return false;
-        return true;
+    Token::TokenKind kind_of(const char* s, size_t len) const {
+        const Slot& slot = slots[hash(s, len)];
+        if (slot.word.size() == len && memcmp(slot.word.data(), s, len) == 0)
+            return slot.kind;
+        return Token::TT_ID;
     }
+};
 
-    Token make_string() {
-        auto begin = make_pos();
-        char eof = current;
-        advance();
-        std::string tmp;
-        while (current && current != eof) {
-            if (current == '\\') {
-                advance();
-                if (current == 'n') tmp += '\n', advance();
-                else if (current == 'r') tmp += '\r', advance();
-                else if (current == 'b') tmp += '\b', advance();
-                else if (current == 't') tmp += '\t', advance();
-                else if (current == 'a') tmp += '\a', advance();
-                else if (current == 'f') tmp += '\f', advance();
-                else if (current == 'v') tmp += '\v', advance();
-                else if (std::isdigit(current)) tmp += (char)(std::stoi(make_digit().data));
-                else tmp += current, advance();
-                continue;
+const KeywordTable keyword_table;
+
+// The operators as a trie over their characters; the lexer walks it as far
+// as the input allows and takes the last accepting node.
+struct OperatorTrie {
+    struct Node { int16_t next[128]; bool accept; };
+    std::vector<Node> nodes;
+
+    OperatorTrie() {
+        nodes.push_back(empty());
+        for (auto& op : ops) {
+            int n = 0;
+            for (unsigned char c : op) {
+                if (nodes[n].next[c] < 0) {
+                    nodes[n].next[c] = nodes.size();
+                    nodes.push_back(empty());
+                }
+                n = nodes[n].next[c];
             }
-            tmp += current;
-            advance();
+            nodes[n].accept = true;
         }
-        advance();
-        auto end = make_pos();
-        return Token(tmp, Token::TT_STRING, begin, end);
-    }
-
-    Token make_digit() {
-        auto begin = make_pos();
-        Token::TokenKind kind = Token::TT_INTEGER;
-        std::string tmp;
-        while (current && (std::isdigit(current) || current == '.')) {
-            tmp += current;
-            if (current == '.') kind = Token::TT_FLOAT;
-            advance();
+    }
+
+    static Node empty() {
+        Node node;
+        std::fill(std::begin(node.next), std::end(node.next), -1);
+        node.accept = false;
+        return node;
+    }
+
+    // Length of the longest operator at `p`, 0 when none starts there.
+    size_t match(const char* p, const char* end) const {
+        size_t best = 0;
+        int n = 0;
+        for (const char* q = p; q < end && (unsigned char)*q < 128; ++q) {
+            n = nodes[n].next[(unsigned char)*q];
+            if (n < 0)
+                break;
+            if (nodes[n].accept)
+                best = q - p + 1;
         }
-        auto end_pos = make_pos();
-        return Token(tmp, kind, begin, end_pos);
+        return best;
     }
+};
 
-    Token make_id() {
-        auto begin = make_pos();
-        Token::TokenKind kind = Token::TT_ID;
-        std::string data;
-        while (current && (('a' <= current && current <= 'z') || ('A' <= current && current <= 'Z') || current == '_' || std::isdigit(current))) {
-            data += current;
-            advance();
+const OperatorTrie operator_trie;
+
+size_t scan_digits(std::string_view s, size_t i, Token::TokenKind* kind = nullptr) {
+    while (i < s.size() && (char_table.is(s[i], CC_DIGIT) || s[i] == '.')) {
+        if (s[i] == '.' && kind) *kind = Token::TT_FLOAT;
+        ++i;
+    }
+    return i;
+}
+
+// The value of a string literal from its raw text.
+std::string decode_string(std::string_view raw) {
+    std::string res;
+    res.reserve(raw.size());
+    for (size_t i = 0; i < raw.size();) {
+        char c = raw[i];
+        if (c == '\\' && i + 1 < raw.size()) {
+            c = raw[++i];
+            switch (c) {
+            case 'n': res += '\n'; ++i; continue;
+            case 'r': res += '\r'; ++i; continue;
+            case 'b': res += '\b'; ++i; continue;
+            case 't': res += '\t'; ++i; continue;
+            case 'a': res += '\a'; ++i; continue;
+            case 'f': res += '\f'; ++i; continue;
+            case 'v': res += '\v'; ++i; continue;
+            }
+            if (char_table.is(c, CC_DIGIT)) {
+                size_t e = scan_digits(raw, i);
+                res += (char)std::stoi(std::string(raw.substr(i, e - i)));
+                i = e;
+                continue;
+            }
         }
-        if (std::count(keys.begin(), keys.end(), data) == 1) kind = Token::TT_KEY;
-        else if (data == "true" || data == "false") kind = Token::TT_BOOL;
-        auto end = make_pos();
-        return Token(data, kind, begin, end);
-    }
-
-    void skip() {
-        while (current && (current != '\n' && current != '\r'))
-            advance();
-    }
-
-    void make_tokens() {
-        while (current) {
-            if (std::isdigit(current)) tokens.push_back(make_digit());
-            else if (('a' <= current && current <= 'z') || ('A' <= current && current <= 'Z') || current == '_')
-                tokens.push_back(make_id());
-            else if (current == '\'' || current == '"') tokens.push_back(make_string());
-            else if (current == '#') skip();
-            else if (!std::isspace(current)) {
-                std::string res;
-                bool isf = false;
-                for (auto i : ops)
-                    if (back_comp(i) && i.size() > res.size())
-                        res = i, isf = true;
-                if (isf) {
-                    tokens.emplace_back(res, Token::TT_OP, make_pos(), make_pos());
-                    advance(res.size());
-                    continue;
-                } else {
-                    tokens.emplace_back(std::string(1, current), Token::TT_OP, make_pos(), make_pos());
-                    advance();
-                }
+        res += c;
+        ++i;
+    }
+    return res;
+}
+
+// Tokenizes a source without copying it, one token per call to next(); the
+// parser pulls tokens as it goes, so no token list is ever built. The source
+// must outlive the lexer and the tokens it hands out.
+class Lexer {
+public:
+    Lexer(std::string_view expr) {
+        this->expr = expr;
+        lin = 1;
+    }
+
+    // Lexes a slice of a larger source: `lin` is the line the slice starts
+    // on and `line_start` the offset of that line's newline, relative to the
+    // slice, so positions come out as in the whole file.
+    Lexer(std::string_view expr, int lin, long line_start) {
+        this->expr = expr;
+        this->lin = lin;
+        this->line_start = line_start;
+    }
+
+    int lin, col = 1;
+
+    std::string_view source() const { return expr; }
+
+    // The next token into `out`; false at the end of the source.
+    bool next(Token& out) {
+        const char* s = expr.data();
+        size_t n = expr.size();
+        while (i < n && s[i]) {
+            char c = s[i];
+            if (char_table.is(c, CC_SPACE)) {
+                ++i;
+            } else if (c == '#') {
+                while (i < n && s[i] && !char_table.is(s[i], CC_NEWLINE))
+                    ++i;
+            } else if (char_table.is(c, CC_DIGIT)) {
+                Token::TokenKind kind = Token::TT_INTEGER;
+                size_t e = scan_digits(expr, i, &kind);
+                return emit(out, kind, i, e);
+            } else if (char_table.is(c, CC_ID_START)) {
+                size_t e = i + 1;
+                while (e < n && char_table.is(s[e], CC_ID))
+                    ++e;
+                return emit(out, keyword_table.kind_of(s + i, e - i), i, e);
+            } else if (char_table.is(c, CC_QUOTE)) {
+                size_t from = i + 1, e = from;
+                while (e < n && s[e] && s[e] != c)
+                    e += (s[e] == '\\' && e + 1 < n) ? 2 : 1;
+                out = Token(Token::TT_STRING, from, e - from, pos_at(i));
+                i = e < n ? e + 1 : e;
+                return true;
             } else {
-                advance();
+                size_t len = std::max<size_t>(1, operator_trie.match(s + i, s + n));
+                return emit(out, Token::TT_OP, i, i + len);
             }
         }
+        pos_at(i);
+        return false;
+    }
+
+private:
+    std::string_view expr;
+    size_t i = 0;
+    // Lines are counted lazily up to the last position asked for. A '\n' or
+    // '\r' starts a line of its own and sits at column 1.
+    size_t counted = 0;
+    long line_start = -1;
+
+    Position pos_at(size_t at) {
+        size_t last = std::min(at + 1, expr.size());
+        for (; counted < last; ++counted)
+            if (char_table.is(expr[counted], CC_NEWLINE))
+                ++lin, line_start = counted;
+        col = (int)(at - line_start + 1);
+        return {lin, col};
+    }
+
+    bool emit(Token& out, Token::TokenKind kind, size_t from, size_t to) {
+        out = Token(kind, from, to - from, pos_at(from));
+        i = to;
+        return true;
     }
 };
 
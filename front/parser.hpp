@@ -7,11 +7,12 @@
 #include <vector>
 #include <unordered_map>
 
+// The tree lives in the parser's arena: it is released in one go when the
+// parser is destroyed, so keep the parser until compilation is done.
 class Parser {
+    AstArena arena;
 public:
-    Parser(std::vector<Token> tokens) {
-        this->tokens = tokens;
-        pos = -1;
+    Parser(Lexer& lexer) : lexer(lexer), src(lexer.source()) {
         current = nullptr;
         advance();
         make_all();
@@ -39,9 +40,9 @@ public:
             }
             else {
                 auto tmp = make_expression();
-                if (std::count(self_operator.begin(), self_operator.end(), current->data) == 1 &&
+                if (std::count(self_operator.begin(), self_operator.end(), text()) == 1 &&
                     (tmp->kind == AST::A_ID || tmp->kind == AST::A_MEMBER_ACCESS || tmp->kind == AST::A_ELEMENT_GET)) {
-                    std::string op = current->data;
+                    std::string op(text());
                     advance();
                     auto val = make_expression();
                     tmp = new SelfOperator(op, tmp, val);
@@ -53,25 +54,36 @@ public:
     }
 
 private:
-    std::vector<Token> tokens;
-    int pos;
-    Token* current;
+    Lexer& lexer;
+    std::string_view src;
+    Token token;
+    const Token* current;
+
+    std::string_view text() { return current->text(src); }
+
+    // The current token as a value: string literals have their escapes
+    // decoded, anything else is copied as written.
+    std::string value() {
+        if (current->kind == Token::TT_STRING)
+            return decode_string(text());
+        return std::string(text());
+    }
 
     bool match(Token::TokenKind kind) { return current != nullptr && current->kind == kind; }
 
-    bool match(std::string data) { return current != nullptr && current->data == data; }
+    bool match(std::string_view data) { return current != nullptr && text() == data; }
 
     std::string expect_get(Token::TokenKind kind) {
         if (!match(kind))
-            make_error("SyntaxError", "want '" + std::to_string(kind) + "' get '" + current->data + "'");
-        auto tmp = current->data;
+            make_error("SyntaxError", "want '" + std::to_string(kind) + "' get '" + std::string(text()) + "'");
+        auto tmp = value();
         advance();
         return tmp;
     }
 
-    void expect_data(std::string name, Position _pos) {
+    void expect_data(std::string_view name, Position _pos) {
         if (!current || !match(name))
-            make_error("SyntaxError", "want '" + name + "', meet '" + ((current)? current->data : "None"), _pos);
+            make_error("SyntaxError", "want '" + std::string(name) + "', meet '" + ((current)? std::string(text()) : "None"), _pos);
         advance();
     }
 
@@ -145,7 +157,7 @@ private:
             return new SwitchUnit(make_block());
         } else {
             printf("unknown token: ");
-            current->debug();
+            current->debug(src);
             exit(-1);
         }
     }
@@ -256,7 +268,7 @@ private:
         std::unordered_map<std::string, AST*> members;
         std::unordered_map<std::string, ObjectNode::AccessState> as;
         std::string name = expect_get(Token::TT_ID);
-		std::vector<std::string> ext;
+		std::vector<Atom> ext;
 		if (match("(")) {
 			advance();
 			while (current && !match(")")) {
@@ -272,7 +284,7 @@ private:
             if (match("public")) advance(), _as = ObjectNode::PUBLIC;
             else if (match("private")) advance(),_as = ObjectNode::PRIVATE;
             if (match("def") || match("constructor")) {
-                std::string __name = current->data;
+                std::string __name(text());
                 if (__name == "constructor") _as = ObjectNode::PUBLIC;
                 auto tmp = make_function_define();
                 members[tmp->name] = tmp;
@@ -310,9 +322,9 @@ private:
             }
             else {
                 auto tmp = make_expression();
-                if (std::count(self_operator.begin(), self_operator.end(), current->data) == 1 &&
+                if (std::count(self_operator.begin(), self_operator.end(), text()) == 1 &&
                     (tmp->kind == AST::A_ID || tmp->kind == AST::A_MEMBER_ACCESS || tmp->kind == AST::A_ELEMENT_GET)) {
-                    std::string op = current->data;
+                    std::string op(text());
                     advance();
                     auto val = make_expression();
                     tmp = new SelfOperator(op, tmp, val);
@@ -340,9 +352,9 @@ private:
             }
             else {
                 auto tmp = make_expression();
-                if (std::count(self_operator.begin(), self_operator.end(), current->data) == 1 &&
+                if (std::count(self_operator.begin(), self_operator.end(), text()) == 1 &&
                     (tmp->kind == AST::A_ID || tmp->kind == AST::A_MEMBER_ACCESS || tmp->kind == AST::A_ELEMENT_GET)) {
-                    std::string op = current->data;
+                    std::string op(text());
                     advance();
                     auto val = make_expression();
                     tmp = new SelfOperator(op, tmp, val);
@@ -355,19 +367,14 @@ private:
         return new Block(codes);
     }
 
-    void advance() {
-        ++pos;
-        current = nullptr;
-        if (pos < tokens.size())
-            current = &tokens[pos];
-    }
+    void advance() { current = lexer.next(token) ? &token : nullptr; }
 
-    AST* make_bin_op_node(CALLBACK_FUNCTION left_process, std::vector<std::string> opers, CALLBACK_FUNCTION right_process = nullptr) {
+    AST* make_bin_op_node(CALLBACK_FUNCTION left_process, std::initializer_list<std::string_view> opers, CALLBACK_FUNCTION right_process = nullptr) {
         if (right_process == nullptr)
             right_process = left_process;
         AST* left = (this->*left_process)();
-        while (current && std::count(opers.begin(), opers.end(), current->data) > 0) {
-            std::string op = current->data;
+        while (current && std::count(opers.begin(), opers.end(), text()) > 0) {
+            Atom op(text());
             advance();
             AST* right = (this->*right_process)();
             left = new BinOpNode(op, left, right);
@@ -422,7 +429,7 @@ private:
     }
 
     AST* make_member_access() {
-        AST* left = new IdNode(current->data);
+        AST* left = new IdNode(text());
         advance();
         return _make_member_access(left);
     }
@@ -430,7 +437,7 @@ private:
     AST* _make_member_access(AST* left) {
         while (current && match(".")) {
             advance();
-            left = new MemberAccessNode(left, current->data);
+            left = new MemberAccessNode(left, text());
             advance();
         }
         return left;
@@ -449,7 +456,7 @@ private:
             return new SelfOperator(op, tmp, value);
         } else {
             std::cout << "unknown token: ";
-            current->debug();
+            current->debug(src);
             std::cout << std::endl;
             exit(-1);
         }
@@ -471,7 +478,7 @@ private:
 
     AST* make_value() {
         if (match(Token::TT_INTEGER)) {
-            auto tmp = new IntegerNode(current->data);
+            auto tmp = new IntegerNode(text());
             advance();
             return tmp;
         } else if (match("$")) {
@@ -487,7 +494,7 @@ private:
         } else if (match("new")) {
             return make_malloc();
         } else if (match(Token::TT_FLOAT)) {
-            auto tmp = new FloatNode(current->data);
+            auto tmp = new FloatNode(text());
             advance();
             return tmp;
         } else if (match("[")) {
@@ -502,7 +509,7 @@ private:
             }
             return tmp;
         } else if (match(Token::TT_STRING)) {
-            auto t = new StringNode(current->data);
+            auto t = new StringNode(value());
             advance();
             return t;
         } else if (match("~")) {
@@ -0,0 +1,144 @@
+#ifndef COPL_PROGRAM_PARSER_HPP
+#define COPL_PROGRAM_PARSER_HPP
+
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "time_report.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#define PARALLEL_PARSE_MIN (256 * 1024)
+
+// A run of whole top-level statements, with the line it starts on.
+struct SourceSlice {
+    size_t begin, end;
+    int lin;
+    long line_start;
+};
+
+// Cuts a source into slices of at least `target` bytes. A cut is only made
+// in front of a `def`, `class`, `import` or `let` that starts a top-level
+// statement: outside any brackets, strings and comments, right after a `;`
+// or `}`.
+std::vector<SourceSlice> split_top_level(std::string_view s, size_t target) {
+    std::vector<SourceSlice> slices;
+    SourceSlice cur {0, 0, 1, -1};
+    int depth = 0, lin = 1;
+    long line_start = -1;
+    char prev = ';';
+    size_t n = s.size(), i = 0;
+    while (i < n) {
+        char c = s[i];
+        if (char_table.is(c, CC_NEWLINE)) {
+            ++lin, line_start = (long)i;
+            ++i;
+        } else if (char_table.is(c, CC_SPACE)) {
+            ++i;
+        } else if (c == '#') {
+            while (i < n && !char_table.is(s[i], CC_NEWLINE))
+                ++i;
+        } else if (char_table.is(c, CC_QUOTE)) {
+            for (++i; i < n && s[i] != c; ++i) {
+                if (s[i] == '\\' && i + 1 < n)
+                    ++i;
+                if (char_table.is(s[i], CC_NEWLINE))
+                    ++lin, line_start = (long)i;
+            }
+            ++i;
+            prev = c;
+        } else if (char_table.is(c, CC_ID)) {
+            size_t e = i + 1;
+            while (e < n && char_table.is(s[e], CC_ID))
+                ++e;
+            std::string_view word = s.substr(i, e - i);
+            if (depth == 0 && (prev == ';' || prev == '}') && i - cur.begin >= target &&
+                (!word.compare("def") || !word.compare("class") || !word.compare("import") || !word.compare("let"))) {
+                cur.end = i;
+                slices.push_back(cur);
+                cur = {i, 0, lin, line_start};
+            }
+            i = e;
+            prev = 'a';
+        } else {
+            if (c == '(' || c == '[' || c == '{')
+                ++depth;
+            else if ((c == ')' || c == ']' || c == '}') && depth > 0)
+                --depth;
+            prev = c;
+            ++i;
+        }
+    }
+    cur.end = n;
+    slices.push_back(cur);
+    return slices;
+}
+
+// The parser pulls tokens from the lexer as it goes, so with a TimeReport
+// active the source is lexed once on its own beforehand to tell the two
+// apart; the "parse" phase still includes the lexing it does.
+void report_lexing(const std::string& name, std::string_view source) {
+    if (!TimeReport::active())
+        return;
+    TimeReport::Scope phase(name, "lex");
+    Lexer lexer(source);
+    for (Token t; lexer.next(t);)
+        ;
+}
+
+// Parses a whole program. Big sources are split with split_top_level and
+// the slices lexed and parsed on a few threads, each into an arena of its
+// own; the statements are then put back together in source order.
+// Set COPL_PARSE_THREADS to override the number of threads.
+//
+// The trees live as long as this object, so keep it until compilation is
+// done. Its own arena stays current on the calling thread meanwhile and
+// takes the nodes the compiler adds.
+class ProgramParser {
+    AstArena arena;
+public:
+    std::vector<AST*> ast;
+
+    explicit ProgramParser(std::string_view source) {
+        size_t threads = thread_count();
+        if (threads <= 1 || source.size() < PARALLEL_PARSE_MIN) {
+            Lexer lexer(source);
+            parts.emplace_back(new Parser(lexer));
+            ast = parts.back()->ast;
+            return;
+        }
+        std::vector<SourceSlice> slices = split_top_level(source, std::max<size_t>(64 * 1024, source.size() / (threads * 4)));
+        parts.resize(slices.size());
+        std::atomic<size_t> next(0);
+        auto work = [&] {
+            for (size_t k; (k = next++) < slices.size();) {
+                const SourceSlice& sl = slices[k];
+                Lexer lexer(source.substr(sl.begin, sl.end - sl.begin), sl.lin, sl.line_start - (long)sl.begin);
+                parts[k].reset(new Parser(lexer));
+            }
+        };
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < std::min(threads, slices.size()); ++t)
+            workers.emplace_back(work);
+        for (auto& w : workers)
+            w.join();
+        for (auto& p : parts)
+            ast.insert(ast.end(), p->ast.begin(), p->ast.end());
+    }
+
+private:
+    std::vector<std::unique_ptr<Parser>> parts;
+
+    static size_t thread_count() {
+        const char* env = getenv("COPL_PARSE_THREADS");
+        if (env && *env)
+            return (size_t)std::max(1, atoi(env));
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+};
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef COPL_SOURCE_FILE_HPP
+#define COPL_SOURCE_FILE_HPP
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// An .opl source mapped read-only for as long as it is being compiled. The
+// lexer works on the mapping in place; names and literals are copied into
+// the AST arena, so the file can be unmapped as soon as parsing is done.
+struct SourceFile {
+    SourceFile() {}
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+    ~SourceFile() { close(); }
+
+    bool open(const std::string& filename) {
+        close();
+#ifdef _WIN32
+        HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER len;
+        GetFileSizeEx(file, &len);
+        size = (size_t)len.QuadPart;
+        if (size) {
+            HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping) {
+                data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+#else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        fstat(fd, &st);
+        size = (size_t)st.st_size;
+        if (size) {
+            void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            data = (p == MAP_FAILED) ? nullptr : (const char*)p;
+        }
+        ::close(fd);
+#endif
+        return size == 0 || data != nullptr;
+    }
+
+    void close() {
+        if (data) {
+#ifdef _WIN32
+            UnmapViewOfFile(data);
+#else
+            munmap((void*)data, size);
+#endif
+        }
+        data = nullptr;
+        size = 0;
+    }
+
+    std::string_view text() const { return {data ? data : "", size}; }
+
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+};
+
+#endif
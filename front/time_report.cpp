@@ -0,0 +1,21 @@
+#include "time_report.hpp"
+#include <cstdlib>
+#include <new>
+
+// Replaces the global operator new so AllocCounter sees every allocation.
+// Kept out of the header: a program may only define it once.
+
+void* operator new(size_t size) {
+    if (AllocCounter::enabled().load(std::memory_order_relaxed)) {
+        AllocCounter::count().fetch_add(1, std::memory_order_relaxed);
+        AllocCounter::bytes().fetch_add(size, std::memory_order_relaxed);
+        AllocCounter::thread_count()++;
+        AllocCounter::thread_bytes() += size;
+    }
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
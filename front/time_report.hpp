@@ -0,0 +1,267 @@
+#ifndef COPL_TIME_REPORT_HPP
+#define COPL_TIME_REPORT_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// Slowest functions listed by a report.
+#define TIME_REPORT_TOP 10
+
+// Calls to the global operator new, counted while a TimeReport is active.
+// Nodes and values come from AstArena and PoolAllocator chunks, which show
+// up here only as the chunks they take. The counting operator new is in
+// time_report.cpp, which only the command line build links; without it the
+// counts stay at zero.
+//
+// The thread_ counters only see the calling thread, so a function compiled
+// on a codegen thread is not charged for what the others allocate meanwhile.
+struct AllocCounter {
+    static std::atomic<bool>& enabled() { static std::atomic<bool> e(false); return e; }
+    static std::atomic<size_t>& count() { static std::atomic<size_t> c(0); return c; }
+    static std::atomic<size_t>& bytes() { static std::atomic<size_t> b(0); return b; }
+    static size_t& thread_count() { static thread_local size_t c = 0; return c; }
+    static size_t& thread_bytes() { static thread_local size_t b = 0; return b; }
+};
+
+// Where compile time and memory go, per phase of each source and per
+// function, for --time-report. Phases nest as imports are compiled from
+// inside a compilation: a phase stops counting while one inside it runs, so
+// the numbers of all phases add up to the total.
+//
+// Peak memory is the process high-water mark when a phase ends, so it only
+// grows from one phase to the next.
+struct TimeReport {
+    struct Phase {
+        std::string source, name;
+        double secs = 0;
+        size_t allocs = 0, bytes = 0, peak = 0;
+    };
+
+    struct Function {
+        std::string source, name;
+        double secs;
+        size_t allocs, bytes;
+    };
+
+    std::vector<Phase> phases;
+    std::vector<Function> functions;
+    // Functions taken from a FunctionCache instead of compiled. They took
+    // no codegen time and are not in `functions`.
+    size_t reused = 0;
+
+    TimeReport() {
+        active() = this;
+        AllocCounter::enabled() = true;
+    }
+
+    ~TimeReport() {
+        AllocCounter::enabled() = false;
+        active() = nullptr;
+    }
+
+    TimeReport(const TimeReport&) = delete;
+    TimeReport& operator=(const TimeReport&) = delete;
+
+    static TimeReport*& active() {
+        static TimeReport* r = nullptr;
+        return r;
+    }
+
+    // Times one phase of `source` for the active report, if there is one.
+    class Scope {
+    public:
+        Scope(const std::string& source, const char* name) : report(active()) {
+            if (!report)
+                return;
+            if (!report->open.empty())
+                report->pause(report->open.back());
+            report->open.push_back(report->phases.size());
+            report->phases.push_back({source, name});
+            report->resume();
+        }
+
+        ~Scope() { close(); }
+
+        // Ends the phase early, for what has to outlive it.
+        void close() {
+            if (!report)
+                return;
+            size_t k = report->open.back();
+            report->pause(k);
+            report->phases[k].peak = peak_memory();
+            report->open.pop_back();
+            if (!report->open.empty())
+                report->resume();
+            report = nullptr;
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        TimeReport* report;
+    };
+
+    // Times the compilation of one function and counts what it allocates,
+    // see Compiler::visit_func_node. Safe on the codegen threads. Lambdas
+    // inside a function are included in its numbers.
+    class FunctionScope {
+    public:
+        explicit FunctionScope(const std::string& name) : report(active()) {
+            if (report) {
+                this->name = name;
+                allocs_since = AllocCounter::thread_count();
+                bytes_since = AllocCounter::thread_bytes();
+                begin = std::chrono::steady_clock::now();
+            }
+        }
+
+        ~FunctionScope() {
+            if (!report)
+                return;
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            size_t allocs = AllocCounter::thread_count() - allocs_since;
+            size_t bytes = AllocCounter::thread_bytes() - bytes_since;
+            std::lock_guard<std::mutex> lock(report->functions_mutex);
+            std::string source = report->open.empty() ? "" : report->phases[report->open.back()].source;
+            report->functions.push_back({source, name, secs, allocs, bytes});
+        }
+
+        FunctionScope(const FunctionScope&) = delete;
+        FunctionScope& operator=(const FunctionScope&) = delete;
+
+    private:
+        TimeReport* report;
+        std::string name;
+        size_t allocs_since = 0, bytes_since = 0;
+        std::chrono::steady_clock::time_point begin;
+    };
+
+    void print(FILE* out) {
+        Phase total = totals();
+        fprintf(out, "%-32s %-8s %10s %10s %12s %10s\n", "source", "phase", "ms", "allocs", "alloc KB", "peak KB");
+        for (auto& p : phases)
+            fprintf(out, "%-32s %-8s %10.3f %10zu %12zu %10zu\n", p.source.c_str(), p.name.c_str(),
+                    p.secs * 1e3, p.allocs, p.bytes / 1024, p.peak / 1024);
+        fprintf(out, "%-32s %-8s %10.3f %10zu %12zu %10zu\n", "total", "", total.secs * 1e3,
+                total.allocs, total.bytes / 1024, total.peak / 1024);
+        auto top = slowest();
+        if (!top.empty()) {
+            fprintf(out, "\n%zu of %zu functions, slowest to compile:\n", top.size(), functions.size());
+            fprintf(out, "%10s %10s %12s  %s\n", "ms", "allocs", "alloc bytes", "function");
+            for (auto f : top)
+                fprintf(out, "%10.3f %10zu %12zu  %s  %s\n", f->secs * 1e3, f->allocs, f->bytes,
+                        f->name.c_str(), f->source.c_str());
+        }
+        if (reused)
+            fprintf(out, "\n%zu functions reused from the function cache are not listed.\n", reused);
+    }
+
+    void print_json(FILE* out) {
+        Phase total = totals();
+        fprintf(out, "{\"phases\":[");
+        for (size_t k = 0; k < phases.size(); ++k) {
+            auto& p = phases[k];
+            fprintf(out, "%s{\"source\":%s,\"phase\":\"%s\",\"ms\":%.3f,\"allocs\":%zu,\"alloc_bytes\":%zu,\"peak_bytes\":%zu}",
+                    k ? "," : "", quote(p.source).c_str(), p.name.c_str(), p.secs * 1e3, p.allocs, p.bytes, p.peak);
+        }
+        fprintf(out, "],\"total\":{\"ms\":%.3f,\"allocs\":%zu,\"alloc_bytes\":%zu,\"peak_bytes\":%zu},",
+                total.secs * 1e3, total.allocs, total.bytes, total.peak);
+        fprintf(out, "\"functions\":%zu,\"reused\":%zu,\"slowest\":[", functions.size(), reused);
+        auto top = slowest();
+        for (size_t k = 0; k < top.size(); ++k)
+            fprintf(out, "%s{\"source\":%s,\"name\":%s,\"ms\":%.3f,\"allocs\":%zu,\"alloc_bytes\":%zu}",
+                    k ? "," : "", quote(top[k]->source).c_str(), quote(top[k]->name).c_str(),
+                    top[k]->secs * 1e3, top[k]->allocs, top[k]->bytes);
+        fprintf(out, "]}\n");
+    }
+
+    static size_t peak_memory() {
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS pmc;
+        if (K32GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+            return pmc.PeakWorkingSetSize;
+        return 0;
+#else
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+        return (size_t)ru.ru_maxrss;
+#else
+        return (size_t)ru.ru_maxrss * 1024;
+#endif
+#endif
+    }
+
+private:
+    std::vector<size_t> open;
+    std::chrono::steady_clock::time_point since;
+    size_t allocs_since = 0, bytes_since = 0;
+    std::mutex functions_mutex;
+
+    void resume() {
+        since = std::chrono::steady_clock::now();
+        allocs_since = AllocCounter::count();
+        bytes_since = AllocCounter::bytes();
+    }
+
+    void pause(size_t k) {
+        phases[k].secs += std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+        phases[k].allocs += AllocCounter::count() - allocs_since;
+        phases[k].bytes += AllocCounter::bytes() - bytes_since;
+    }
+
+    Phase totals() const {
+        Phase t;
+        for (auto& p : phases) {
+            t.secs += p.secs;
+            t.allocs += p.allocs;
+            t.bytes += p.bytes;
+            t.peak = std::max(t.peak, p.peak);
+        }
+        return t;
+    }
+
+    std::vector<const Function*> slowest() const {
+        std::vector<const Function*> top;
+        for (auto& f : functions)
+            top.push_back(&f);
+        size_t n = std::min<size_t>(TIME_REPORT_TOP, top.size());
+        std::partial_sort(top.begin(), top.begin() + n, top.end(),
+                          [](const Function* a, const Function* b) { return a->secs > b->secs; });
+        top.resize(n);
+        return top;
+    }
+
+    static std::string quote(const std::string& s) {
+        std::string out = "\"";
+        for (unsigned char c : s) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (c < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out += buf;
+            } else {
+                out += c;
+            }
+        }
+        return out + "\"";
+    }
+};
+
+#endif
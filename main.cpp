@@ -1,16 +1,22 @@
 #include "running/vm.hpp"
 #include "front/parser.hpp"
+#include "front/program_parser.hpp"
 #include "front/code_writer.hpp"
 #include "front/compiler.hpp"
+#include "front/build_cache.hpp"
+#include "front/source_file.hpp"
+#include "front/time_report.hpp"
+#include "running/linker.hpp"
 #include <iostream>
 #include <fstream>
+#include <chrono>
+#include <memory>
 
-std::string read_file(std::string name) {
-    std::ifstream ifs(name);
-    std::string buffer, res;
-    while (std::getline(ifs, buffer))
-        res += buffer + '\n';
-    return res;
+void open_source(SourceFile& source, const std::string& name) {
+    if (!source.open(name)) {
+        printf("Cannot open source file: %s\n", name.c_str());
+        exit(-1);
+    }
 }
 
 void shell() {
@@ -18,16 +24,98 @@ void shell() {
         std::string data;
         while (printf("> ") && std::getline(std::cin, data)) {
             Lexer lexer(data);
-            for (auto i : lexer.tokens)
-                i.debug(), printf("\n");
+            for (Token t; lexer.next(t);)
+                t.debug(lexer.source()), printf("\n");
         }
     }
 }
 
+// Lexes `name` repeated to at least 32 MB a few times and reports the best
+// throughput.
+void lexer_benchmark(const std::string& name) {
+    SourceFile unit;
+    open_source(unit, name);
+    if (unit.text().empty())
+        return;
+    std::string source;
+    while (source.size() < (32u << 20))
+        source += unit.text();
+    double best = 0;
+    size_t count = 0;
+    for (int run = 0; run < 5; ++run) {
+        auto begin = std::chrono::steady_clock::now();
+        Lexer lexer(source);
+        count = 0;
+        for (Token t; lexer.next(t);)
+            ++count;
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        best = std::max(best, source.size() / 1e6 / secs);
+    }
+    printf("%.1f MB, %zu tokens: %.1f MB/s\n", source.size() / 1e6, count, best);
+}
+
+// Compiles a generated program of `count` classes with 32 fields each and as
+// many functions using them, and reports the best of a few runs.
+void compile_benchmark(int count) {
+    std::string source;
+    for (int k = 0; k < count; ++k) {
+        std::string c = "C" + std::to_string(k);
+        source += "class " + c + " {\n";
+        for (int f = 0; f < 32; ++f)
+            source += "\tpublic f" + std::to_string(f) + ": int;\n";
+        source += "\tconstructor(v: int) {\n";
+        for (int f = 0; f < 32; ++f)
+            source += "\t\tthis.f" + std::to_string(f) + " = v + " + std::to_string(f) + ";\n";
+        source += "\t}\n\tpublic def sum() {\n\t\treturn this.f0";
+        for (int f = 1; f < 32; ++f)
+            source += " + this.f" + std::to_string(f);
+        source += ";\n\t}\n}\n";
+        source += "let g" + std::to_string(k) + ": int;\n";
+        source += "def f" + std::to_string(k) + "(a: int) {\n\tlet o: " + c + " = new " + c + "(a);\n";
+        source += "\tlet s: int = o.sum();\n";
+        for (int f = 0; f < 32; f += 4)
+            source += "\ts = s + o.f" + std::to_string(f) + " * o.f" + std::to_string(31 - f) + ";\n";
+        if (k > 0)
+            source += "\ts = s + f" + std::to_string(k - 1) + "(a);\n";
+        source += "\treturn s;\n}\n";
+    }
+    source += "def main() {\n\tprintln(f" + std::to_string(count - 1) + "(1));\n}\n";
+
+    double best = 1e9;
+    size_t funcs = 0;
+    for (int run = 0; run < 3; ++run) {
+        ProgramParser parser(source);
+        auto begin = std::chrono::steady_clock::now();
+        CompileOutput opt;
+        ModuleManager mg;
+        Compiler compiler(&opt, parser.ast, &mg);
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+        funcs = opt.funcs.size();
+    }
+    printf("%.1f MB, %zu functions: compiled in %.3f s\n", source.size() / 1e6, funcs, best);
+}
+
+// Set by --time-report, and --time-report=json for the JSON variant.
+bool time_report_json = false;
+
+// Prints where compilation went to stderr, see TimeReport. Allocations are
+// no longer counted after it, so the program runs at full speed.
+void print_time_report() {
+    TimeReport* report = TimeReport::active();
+    if (!report)
+        return;
+    AllocCounter::enabled() = false;
+    if (time_report_json)
+        report->print_json(stderr);
+    else
+        report->print(stderr);
+    fflush(stderr);
+}
+
 int release(int argc, char** argv) {
     if (argc != 3) {
         USAGE:
-        printf("Usage: %s -r|-c|-d <SourceFile>\n", argv[0]);
+        printf("Usage: %s [--time-report[=json]] -r|-c|-d|-s|-l|-b <SourceFile>\n       %s -cb <ClassCount>\n", argv[0], argv[0]);
         exit(0);
     }
     std::string decide = argv[1];
@@ -36,13 +124,42 @@ int release(int argc, char** argv) {
         VM vm(name, false);
         return 0;
     } else if (decide == "-c") {
-        std::string data = read_file(name);
-        Lexer lexer(data);
-        Parser parser(lexer.tokens);
+        SourceFile source;
+        open_source(source, name);
+        report_lexing(name, source.text());
+        TimeReport::Scope parse(name, "parse");
+        ProgramParser parser(source.text());
+        parse.close();
         CompileOutput opt;
 		ModuleManager* mg = new ModuleManager;
+        TimeReport::Scope compile(name, "compile");
         Compiler compiler(&opt, parser.ast, mg);
+        compile.close();
+        TimeReport::Scope save(name, "save");
         save_code(get_file_name(name) + ".copl", &opt);
+        save.close();
+        print_time_report();
+        return 0;
+    } else if (decide == "-s") {
+        // Runs a source file, compiling it only if it or an imported .opl changed.
+        BuildCache cache(BuildCache::default_dir());
+        std::string program = cache.get(name, true);
+        print_time_report();
+        VM vm(program, false);
+        return 0;
+    } else if (decide == "-l") {
+        // Bundles a compiled program with everything it imports.
+        CodeBuffer out = Linker(name).build();
+        std::string bundle = get_file_name(name) + ".bundle.copl";
+        FILE* file = fopen(bundle.c_str(), "wb");
+        fwrite(out.data(), 1, out.size(), file);
+        fclose(file);
+        return 0;
+    } else if (decide == "-b") {
+        lexer_benchmark(name);
+        return 0;
+    } else if (decide == "-cb") {
+        compile_benchmark(std::max(1, atoi(name.c_str())));
         return 0;
     } else if (decide == "-d") {
         for (auto i : load_bytecode(name, builtins))
@@ -55,22 +172,19 @@ int release(int argc, char** argv) {
 }
 
 void file() {
-    std::string data = read_file("D:\\CLionProjects\\COPL\\test\\main");
-    Lexer lexer(data);
-    Parser parser(lexer.tokens);
+    SourceFile source;
+    open_source(source, "D:\\CLionProjects\\COPL\\test\\main");
+    ProgramParser parser(source.text());
     CompileOutput opt;
 	ModuleManager* mg = new ModuleManager;
     Compiler compiler(&opt, parser.ast, mg);
-    VM vm(opt.funcs);
+    VM vm(opt.funcs, opt.shapes);
 }
 
 void compile(std::string __in__, std::string __out__) {
-	std::ifstream ifs(__in__);
-	std::string buffer, res;
-	while (std::getline(ifs, buffer))
-		res += buffer + '\n';
-	Lexer lexer(res);
-	Parser parser(lexer.tokens);
+	SourceFile source;
+	open_source(source, __in__);
+	ProgramParser parser(source.text());
 	ModuleManager* mg = new ModuleManager;
 	CompileOutput op;
 	Compiler compiler(&op, parser.ast, mg);
@@ -78,6 +192,20 @@ void compile(std::string __in__, std::string __out__) {
 }
 
 int main(int argc, char **argv) {
+	std::vector<char*> args;
+	std::unique_ptr<TimeReport> report;
+	for (int i = 0; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--time-report" || arg == "--time-report=json") {
+			if (!report)
+				report.reset(new TimeReport);
+			time_report_json = (arg == "--time-report=json");
+		} else {
+			args.push_back(argv[i]);
+		}
+	}
+	if (args.size() > 1)
+		return release((int)args.size(), args.data());
 	file();
     return 0;
 }
\ No newline at end of file
@@ -1,6 +1,33 @@
 #ifndef COPL_RESFILE_TYPES_HPP
 #define COPL_RESFILE_TYPES_HPP
 
+#include <cstdint>
+
+// v1 files start with COPL_MAGIC_V1 and store everything as 32-bit words.
+// Later files start with COPL_MAGIC followed by a format version: v2 lists
+// the functions one after another, v3 puts an index of them up front and v4
+// adds a table of the modules the file imports.
+#define COPL_MAGIC_V1 0xC0001
+#define COPL_MAGIC 0xC0002
+#define COPL_VERSION 4
+
+// magic, version, function count, class table offset, import table offset;
+// v3 has no import table offset.
+#define COPL_HEADER_SIZE 20
+
+// Images written by snapshot(), see running/snapshot.hpp.
+#define COPL_IMAGE_MAGIC 0xC01A6E
+#define COPL_IMAGE_VERSION 1
+
+struct FuncIndexEntry {
+    int32_t id;
+    int32_t args_len;
+    uint32_t name_offset;
+    uint32_t name_len;
+    uint32_t body_offset;
+    uint32_t body_len;
+};
+
 enum CT {
     BINT = 0X01,
     BFLOAT = 0X02,
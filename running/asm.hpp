@@ -66,7 +66,15 @@ enum Opcode : int {
     OP_HALT,
     OP_NOP,
     OP_ROT,
-    OP_SWAP
+    OP_SWAP,
+
+    OP_NEW_INSTANCE,
+    OP_INVOKE,
+    OP_MEMBER_GET_IC,
+    OP_MEMBER_SET_IC,
+    OP_INVOKE_IC,
+    OP_LOAD_MODULE_METHOD_IC,
+    OP_CALL_MODULE_IC
 };
 
 #endif
@@ -0,0 +1,60 @@
+#ifndef COPL_BYTECODE_HPP
+#define COPL_BYTECODE_HPP
+
+#include <cstdint>
+#include <vector>
+
+// Compact code stream: one byte per opcode, operands as LEB128 varints.
+// A varint may be padded with continuation bytes so that a quickened
+// operand can be rewritten in place without moving the code after it.
+
+inline uint32_t read_varint(uint8_t*& p) {
+    uint32_t b = *p++;
+    if (b < 0x80)
+        return b;
+    uint32_t v = b & 0x7f;
+    int shift = 7;
+    do {
+        b = *p++;
+        v |= (b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return v;
+}
+
+inline int varint_width(uint32_t v) {
+    int w = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        ++w;
+    }
+    return w;
+}
+
+inline void write_varint(uint8_t* p, uint32_t v, int width) {
+    for (int i = 0; i < width - 1; ++i) {
+        *p++ = (uint8_t)(0x80 | (v & 0x7f));
+        v >>= 7;
+    }
+    *p = (uint8_t)v;
+}
+
+inline void append_varint(std::vector<uint8_t>& out, uint32_t v, int width = 0) {
+    if (width < varint_width(v))
+        width = varint_width(v);
+    out.resize(out.size() + width);
+    write_varint(&out[out.size() - width], v, width);
+}
+
+// Rewrites the varint at `p` keeping its encoded width.
+inline void patch_varint(uint8_t* p, uint32_t v) {
+    uint8_t* q = p;
+    read_varint(q);
+    write_varint(p, v, q - p);
+}
+
+inline uint32_t zigzag(int32_t v) { return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31); }
+
+inline int32_t unzigzag(uint32_t v) { return (int32_t)(v >> 1) ^ -(int32_t)(v & 1); }
+
+#endif
@@ -0,0 +1,518 @@
+#ifndef COPL_LINKER_HPP
+#define COPL_LINKER_HPP
+
+#include "value.hpp"
+#include "program_loader.hpp"
+#include "program_writer.hpp"
+#include "module_loader.hpp"
+#include "native_proc.hpp"
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Merges a program and every module it imports into one self-contained
+// .copl. Function and class ids of each file are shifted into a single id
+// space, module calls (OP_LOAD_MODULE_METHOD) become direct OP_CALLs, small
+// leaf functions are inlined into their callers, constant integer
+// arithmetic is folded and whatever main cannot reach is dropped.
+//
+// Code is edited as a list of instructions whose jump operands are
+// instruction indexes, and encoded again once every pass is done.
+
+struct LinkInsn {
+    int op;
+    int arg[2];
+    bool dead = false;
+};
+
+struct LinkUnit {
+    std::string path, name;
+    std::vector<Frame*> funcs;
+    std::vector<ObjectShape*> shapes;
+    std::unordered_map<std::string, int> imports;   // alias -> unit
+    int func_base = 0, shape_base = 0;
+};
+
+struct LinkFunc {
+    Frame* origin;
+    int unit;
+    int id;
+    std::string name;
+    std::vector<LinkInsn> code;
+    std::vector<std::string> names;
+    std::vector<STACK_VALUE*> consts;
+};
+
+#define LINK_INLINE_LIMIT 16
+
+struct Linker {
+    std::vector<LinkUnit> units;
+    std::vector<LinkFunc> funcs;
+    std::vector<ObjectShape*> shapes;
+    std::unordered_map<int, int> func_at;           // linked id -> funcs index
+    size_t inlined = 0, folded = 0, module_calls = 0;
+
+    explicit Linker(const std::string& entry) {
+        load_units(entry);
+        merge();
+        keep_reachable();
+        // Imported files come last, so walking backwards simplifies most
+        // callees before their callers inline them.
+        for (size_t i = funcs.size(); i-- > 0;) {
+            inline_calls(funcs[i]);
+            fold_constants(funcs[i]);
+        }
+    }
+
+    CodeBuffer build() {
+        std::vector<Frame*> frames;
+        for (auto& f : funcs)
+            frames.push_back(emit(f));
+        Frame* main = nullptr;
+        for (auto f : frames)
+            if (f->func_name == "main")
+                main = f;
+        if (!main) {
+            printf("LinkError: '%s' has no main\n", units[0].path.c_str());
+            exit(-1);
+        }
+        return build_program(reachable_functions(frames, {main}), shapes);
+    }
+
+private:
+    void load_units(const std::string& entry) {
+        std::unordered_map<std::string, int> by_path;
+        units.push_back(LinkUnit());
+        units[0].path = entry;
+        by_path[entry] = 0;
+        for (size_t u = 0; u < units.size(); ++u) {
+            std::vector<ImportRef> imports;
+            units[u].funcs = load_bytecode(units[u].path, builtins, &units[u].shapes, &imports);
+            for (auto& i : imports) {
+                auto it = by_path.find(i.first);
+                if (it == by_path.end()) {
+                    it = by_path.emplace(i.first, units.size()).first;
+                    units.push_back(LinkUnit());
+                    units.back().path = i.first;
+                    units.back().name = i.second;
+                }
+                units[u].imports[i.second] = it->second;
+            }
+        }
+    }
+
+    // Ids are made unique by offsetting each file's; functions other than
+    // the entry's get their module's name as prefix. Methods keep theirs,
+    // the VM binds them by class name.
+    void merge() {
+        std::unordered_map<std::string, int> class_unit;
+        int next_func = 0;
+        for (size_t u = 0; u < units.size(); ++u) {
+            LinkUnit& unit = units[u];
+            unit.func_base = next_func;
+            unit.shape_base = shapes.size();
+            for (auto s : unit.shapes) {
+                auto c = class_unit.emplace(s->name, u);
+                if (!c.second) {
+                    printf("LinkError: class '%s' is defined in both '%s' and '%s'\n", s->name.c_str(),
+                           units[c.first->second].path.c_str(), unit.path.c_str());
+                    exit(-1);
+                }
+                shapes.push_back(s);
+            }
+            int max_id = -1;
+            for (auto f : unit.funcs) {
+                max_id = std::max(max_id, f->func_id);
+                LinkFunc lf;
+                lf.origin = f;
+                lf.unit = u;
+                lf.id = unit.func_base + f->func_id;
+                lf.name = f->func_name;
+                if (u && !f->is_build_in && f->func_name.find('$') == std::string::npos)
+                    lf.name = unit.name + "." + f->func_name;
+                if (!f->is_build_in)
+                    decode(f->codes, lf);
+                func_at[lf.id] = funcs.size();
+                funcs.push_back(std::move(lf));
+            }
+            next_func = unit.func_base + max_id + 1;
+        }
+    }
+
+    // Resolves the module calls of what the entry's main reaches, following
+    // them as it goes, and drops every other function. Code main never runs
+    // cannot make the link fail.
+    void keep_reachable() {
+        int main = -1;
+        std::unordered_map<std::string, std::vector<int>> methods;
+        for (size_t i = 0; i < funcs.size(); ++i) {
+            if (funcs[i].unit == 0 && funcs[i].name == "main")
+                main = i;
+            size_t sep = funcs[i].name.find('$');
+            if (sep != std::string::npos)
+                methods[funcs[i].name.substr(sep + 1)].push_back(i);
+        }
+        if (main < 0) {
+            printf("LinkError: '%s' has no main\n", units[0].path.c_str());
+            exit(-1);
+        }
+
+        std::vector<bool> keep(funcs.size(), false);
+        std::vector<int> work;
+        auto mark = [&](int i) {
+            if (!keep[i]) {
+                keep[i] = true;
+                work.push_back(i);
+            }
+        };
+        mark(main);
+        while (!work.empty()) {
+            LinkFunc& f = funcs[work.back()];
+            work.pop_back();
+            resolve_module_calls(f);
+            for (auto& in : f.code) {
+                if (in.dead)
+                    continue;
+                if (in.op == OP_CALL || in.op == OP_LOAD_FUNC_ADDR) {
+                    auto it = func_at.find(in.arg[0]);
+                    if (it != func_at.end())
+                        mark(it->second);
+                } else if (in.op == OP_INVOKE) {
+                    for (int m : methods[f.consts[in.arg[0]]->str_value])
+                        mark(m);
+                }
+            }
+        }
+
+        std::vector<LinkFunc> live;
+        func_at.clear();
+        for (size_t i = 0; i < funcs.size(); ++i)
+            if (keep[i]) {
+                func_at[funcs[i].id] = live.size();
+                live.push_back(std::move(funcs[i]));
+            }
+        funcs = std::move(live);
+    }
+
+    void decode(Chunk* chunk, LinkFunc& lf) {
+        chunk->ensure_loaded();
+        lf.names = chunk->names;
+        lf.consts = chunk->const_pool;
+        std::unordered_map<int, int> index_of;
+        uint8_t* start = chunk->code();
+        uint8_t* p = start;
+        uint8_t* end = start + chunk->code_size();
+        while (p < end) {
+            index_of[p - start] = lf.code.size();
+            LinkInsn in;
+            in.op = *p++;
+            in.arg[0] = in.arg[1] = 0;
+            for (int k = 0; k < instruction_info[in.op].arg_count; ++k)
+                in.arg[k] = read_operand(in.op, p);
+            lf.code.push_back(in);
+        }
+        index_of[chunk->code_size()] = lf.code.size();
+        int base = units[lf.unit].func_base, shape_base = units[lf.unit].shape_base;
+        for (auto& in : lf.code) {
+            if (is_jump(in.op))
+                in.arg[0] = index_of[in.arg[0]];
+            else if (in.op == OP_CALL || in.op == OP_LOAD_FUNC_ADDR)
+                in.arg[0] += base;
+            else if (in.op == OP_NEW_INSTANCE)
+                in.arg[0] += shape_base;
+        }
+    }
+
+    std::vector<bool> jump_targets(const LinkFunc& f) {
+        std::vector<bool> res(f.code.size() + 1, false);
+        for (auto& in : f.code)
+            if (is_jump(in.op))
+                res[in.arg[0]] = true;
+        return res;
+    }
+
+    // Index of the next live instruction after `i`, or -1.
+    int next_live(const LinkFunc& f, int i) {
+        for (++i; i < (int)f.code.size(); ++i)
+            if (!f.code[i].dead)
+                return i;
+        return -1;
+    }
+
+    int prev_live(const LinkFunc& f, int i) {
+        for (--i; i >= 0; --i)
+            if (!f.code[i].dead)
+                return i;
+        return -1;
+    }
+
+    bool is_string_const(const LinkFunc& f, const LinkInsn& in) {
+        if (in.op != OP_LOAD_CONST)
+            return false;
+        STACK_VALUE* v = f.consts[in.arg[0]];
+        return !v->is_heap_ref && v->kind == STACK_VALUE::S_STR;
+    }
+
+    // The compiler emits `LOAD_CONST <module name>; LOAD_MODULE_METHOD
+    // <function>` and, for a call, OP_SPECIAL_CALL right after.
+    void resolve_module_calls(LinkFunc& f) {
+        auto targets = jump_targets(f);
+        LinkUnit& unit = units[f.unit];
+        for (int i = 0; i < (int)f.code.size(); ++i) {
+            LinkInsn& in = f.code[i];
+            if (in.op == OP_LOAD_MODULE) {
+                in.dead = true;
+                continue;
+            }
+            if (in.op != OP_LOAD_MODULE_METHOD)
+                continue;
+            int load = prev_live(f, i);
+            auto mod = (load >= 0 && !targets[i] && is_string_const(f, f.code[load]))
+                       ? unit.imports.find(f.consts[f.code[load].arg[0]]->str_value) : unit.imports.end();
+            if (mod == unit.imports.end()) {
+                printf("LinkError: cannot resolve a module call in '%s'\n", f.name.c_str());
+                exit(-1);
+            }
+            const std::string& method = f.consts[in.arg[0]]->str_value;
+            int id = -1;
+            for (auto g : units[mod->second].funcs)
+                if (!g->is_build_in && g->func_name == method)
+                    id = units[mod->second].func_base + g->func_id;
+            if (id < 0) {
+                printf("LinkError: function '%s' not found in module '%s'\n", method.c_str(), mod->first.c_str());
+                exit(-1);
+            }
+            f.code[load].dead = true;
+            int call = next_live(f, i);
+            if (call >= 0 && !targets[call] && f.code[call].op == OP_SPECIAL_CALL) {
+                in.dead = true;
+                f.code[call] = {OP_CALL, {id, 0}};
+            } else {
+                in = {OP_LOAD_FUNC_ADDR, {id, 0}};
+            }
+            module_calls++;
+        }
+    }
+
+    // Stack effect of the instructions an inlined body may contain, or
+    // nothing for the rest.
+    static bool stack_effect(int op, int* effect) {
+        switch (op) {
+            case OP_LOAD_CONST: case OP_LOAD_NULL: case OP_LOAD_TRUE: case OP_LOAD_FALSE:
+            case OP_LOAD_NAME: case OP_LOAD_IMMEDIATLY: case OP_DUP:
+                *effect = 1; return true;
+            case OP_SET_NAME: case OP_POP: case OP_GET_ELEMENT:
+            case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+            case OP_LEFT: case OP_RIGHT: case OP_BIT_AND: case OP_BIT_OR:
+            case OP_EQ: case OP_NE: case OP_LT: case OP_LE: case OP_GT: case OP_GE:
+            case OP_AND: case OP_OR:
+                *effect = -1; return true;
+            case OP_NEG: case OP_NOT: case OP_BIT_NOT: case OP_COPY: case OP_MEMBER_GET:
+            case OP_SWAP: case OP_ROT: case OP_NOP:
+                *effect = 0; return true;
+            default:
+                return false;
+        }
+    }
+
+    // The OP_RETURN ending a function, which the compiler follows with an
+    // OP_LEAVE that is never reached.
+    int return_at(const LinkFunc& f) {
+        int last = prev_live(f, f.code.size());
+        if (last >= 0 && f.code[last].op == OP_LEAVE)
+            last = prev_live(f, last);
+        return (last >= 0 && f.code[last].op == OP_RETURN) ? last : -1;
+    }
+
+    // Straight-line functions that bind their arguments, compute one value
+    // and return it: nothing they do can see that they are not a frame.
+    bool can_inline(const LinkFunc& f) {
+        if (f.origin->is_build_in || f.code.size() > (size_t)(LINK_INLINE_LIMIT + f.origin->args_len))
+            return false;
+        int argc = f.origin->args_len;
+        int ret = return_at(f);
+        if (ret < argc)
+            return false;
+        for (int k = 0; k < argc; ++k)
+            if (f.code[k].op != OP_SET_NAME || f.code[k].dead)
+                return false;
+        int depth = 0;
+        for (int k = argc; k < ret; ++k) {
+            int effect;
+            if (f.code[k].dead)
+                continue;
+            if (!stack_effect(f.code[k].op, &effect))
+                return false;
+            depth += effect;
+            if (depth < 0 || (f.code[k].op == OP_SWAP && depth < 2) || (f.code[k].op == OP_ROT && depth < 3))
+                return false;
+        }
+        return depth == 1;
+    }
+
+    void inline_calls(LinkFunc& f) {
+        bool any = false;
+        for (auto& in : f.code) {
+            if (in.dead || in.op != OP_CALL)
+                continue;
+            auto it = func_at.find(in.arg[0]);
+            if (it != func_at.end() && &funcs[it->second] != &f && can_inline(funcs[it->second]))
+                any = true;
+        }
+        if (!any)
+            return;
+
+        std::vector<LinkInsn> out;
+        std::vector<int> moved(f.code.size() + 1);
+        for (size_t i = 0; i < f.code.size(); ++i) {
+            moved[i] = out.size();
+            LinkInsn in = f.code[i];
+            auto it = (in.op == OP_CALL && !in.dead) ? func_at.find(in.arg[0]) : func_at.end();
+            if (it == func_at.end() || &funcs[it->second] == &f || !can_inline(funcs[it->second])) {
+                out.push_back(in);
+                continue;
+            }
+            LinkFunc& callee = funcs[it->second];
+            std::string prefix = callee.name + "$inline" + std::to_string(inlined++) + "$";
+            std::unordered_map<int, int> name_map, const_map;
+            auto local = [&](int id) {
+                auto n = name_map.find(id);
+                if (n != name_map.end())
+                    return n->second;
+                f.names.push_back(prefix + callee.names[id]);
+                return name_map[id] = f.names.size() - 1;
+            };
+            // A call moves the arguments onto the callee's stack in reverse,
+            // so its first binding takes the first argument. Inlined, the
+            // last argument is on top: bind the last parameter first.
+            int argc = callee.origin->args_len;
+            for (int k = argc - 1; k >= 0; --k)
+                out.push_back({OP_SET_NAME, {local(callee.code[k].arg[0]), 0}});
+            for (int k = argc, ret = return_at(callee); k < ret; ++k) {
+                LinkInsn body = callee.code[k];
+                if (body.dead)
+                    continue;
+                if (body.op == OP_LOAD_NAME || body.op == OP_SET_NAME)
+                    body.arg[0] = local(body.arg[0]);
+                else if (body.op == OP_LOAD_CONST) {
+                    auto c = const_map.find(body.arg[0]);
+                    if (c == const_map.end()) {
+                        f.consts.push_back(callee.consts[body.arg[0]]);
+                        c = const_map.emplace(body.arg[0], f.consts.size() - 1).first;
+                    }
+                    body.arg[0] = c->second;
+                }
+                out.push_back(body);
+            }
+        }
+        moved[f.code.size()] = out.size();
+        for (auto& in : out)
+            if (is_jump(in.op))
+                in.arg[0] = moved[in.arg[0]];
+        f.code = std::move(out);
+    }
+
+    bool int_value(const LinkFunc& f, const LinkInsn& in, int32_t* v) {
+        if (in.dead)
+            return false;
+        if (in.op == OP_LOAD_IMMEDIATLY) {
+            *v = in.arg[0];
+            return true;
+        }
+        if (in.op == OP_LOAD_CONST) {
+            STACK_VALUE* c = f.consts[in.arg[0]];
+            if (!c->is_heap_ref && c->kind == STACK_VALUE::S_INT) {
+                *v = c->i_val;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Folds `<int> <int> <op>` and drops a store to an inlined argument
+    // that is only read right back. Nothing is folded across a jump target.
+    void fold_constants(LinkFunc& f) {
+        std::vector<int> loads(f.names.size(), 0), stores(f.names.size(), 0);
+        for (auto& in : f.code) {
+            if (in.dead)
+                continue;
+            if (in.op == OP_LOAD_NAME) loads[in.arg[0]]++;
+            if (in.op == OP_SET_NAME) stores[in.arg[0]]++;
+        }
+        auto targets = jump_targets(f);
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (int i = 0; i < (int)f.code.size(); ++i) {
+                LinkInsn& in = f.code[i];
+                if (in.dead)
+                    continue;
+                int j = next_live(f, i);
+                if (j < 0 || targets[j])
+                    continue;
+                if (in.op == OP_SET_NAME && f.code[j].op == OP_LOAD_NAME && in.arg[0] == f.code[j].arg[0]
+                    && loads[in.arg[0]] == 1 && stores[in.arg[0]] == 1
+                    && f.names[in.arg[0]].find("$inline") != std::string::npos) {
+                    in.dead = f.code[j].dead = true;
+                    changed = true;
+                    continue;
+                }
+                int k = next_live(f, j);
+                int32_t a, b;
+                if (k < 0 || targets[k] || !int_value(f, in, &a) || !int_value(f, f.code[j], &b))
+                    continue;
+                double r;
+                switch (f.code[k].op) {
+                    case OP_ADD: r = (double)a + b; break;
+                    case OP_SUB: r = (double)a - b; break;
+                    case OP_MUL: r = (double)a * b; break;
+                    default: continue;
+                }
+                if (r < INT32_MIN || r > INT32_MAX)
+                    continue;
+                in = {OP_LOAD_IMMEDIATLY, {(int32_t)r, 0}};
+                f.code[j].dead = f.code[k].dead = true;
+                folded++;
+                changed = true;
+            }
+        }
+    }
+
+    Frame* emit(LinkFunc& f) {
+        Frame* frame;
+        if (f.origin->is_build_in) {
+            frame = new Frame(f.origin->proc, f.name);
+        } else {
+            Chunk* chunk = new Chunk;
+            std::vector<int> at(f.code.size() + 1);
+            int words = 0;
+            for (size_t i = 0; i < f.code.size(); ++i) {
+                at[i] = words;
+                if (!f.code[i].dead)
+                    words += 1 + instruction_info[f.code[i].op].arg_count;
+            }
+            at[f.code.size()] = words;
+            for (auto& in : f.code) {
+                if (in.dead)
+                    continue;
+                chunk->op_codes.push_back(in.op);
+                for (int k = 0; k < instruction_info[in.op].arg_count; ++k)
+                    chunk->op_codes.push_back(is_jump(in.op) ? at[in.arg[k]] : in.arg[k]);
+            }
+            chunk->names = f.names;
+            chunk->const_pool = f.consts;
+            chunk->encode();
+            frame = new Frame(chunk);
+            frame->func_name = f.name;
+            frame->is_lambda = f.origin->is_lambda;
+        }
+        frame->func_id = f.id;
+        frame->args_len = f.origin->args_len;
+        return frame;
+    }
+};
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef COPL_MODULE_LOADER_HPP
+#define COPL_MODULE_LOADER_HPP
+
+#include "value.hpp"
+#include "program_loader.hpp"
+#include "native_proc.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Loads the import graph of a program on a small thread pool. The import
+// table of each module found is queued in turn, so by the time the VM links
+// a module the file is usually mapped and indexed already.
+//
+// Workers allocate from a pool of their own: the values they create (the
+// class tables and, for files before v4, the constants of a scanned main)
+// outlive it in orphaned arenas, see pool_allocator.hpp.
+struct ModuleLoader {
+    struct Loaded {
+        std::vector<Frame*> funcs;
+        std::vector<ObjectShape*> shapes;
+        std::vector<ImportRef> imports;
+        bool done = false;
+    };
+
+    ~ModuleLoader() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : workers)
+            t.join();
+    }
+
+    // Starts loading `path` and everything it imports in the background.
+    void prefetch(const std::string& path) {
+        std::unique_lock<std::mutex> lock(mutex);
+        enqueue(path);
+        size_t want = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), queue.size() + busy);
+        while (workers.size() < want)
+            workers.emplace_back(&ModuleLoader::work, this);
+        wake.notify_all();
+    }
+
+    // The loaded module, waiting for a prefetch in flight or loading it on
+    // the calling thread when it was never requested.
+    Loaded take(const std::string& path) {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = modules.find(path);
+        if (it == modules.end()) {
+            lock.unlock();
+            return load(path);
+        }
+        auto q = std::find(queue.begin(), queue.end(), path);
+        if (q != queue.end()) {
+            // Not picked up yet, load it here rather than wait for a worker.
+            queue.erase(q);
+            modules.erase(it);
+            lock.unlock();
+            Loaded res = load(path);
+            lock.lock();
+            for (auto& i : res.imports)
+                enqueue(i.first);
+            wake.notify_all();
+            return res;
+        }
+        Loaded* slot = it->second.get();
+        done.wait(lock, [&] { return slot->done; });
+        Loaded res = std::move(*slot);
+        modules.erase(path);
+        return res;
+    }
+
+    static Loaded load(const std::string& path) {
+        Loaded res;
+        res.funcs = load_bytecode(path, builtins, &res.shapes, &res.imports);
+        res.done = true;
+        return res;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    std::deque<std::string> queue;
+    std::unordered_map<std::string, std::unique_ptr<Loaded>> modules;
+    // Every path queued so far; a module is loaded at most once.
+    std::unordered_set<std::string> seen;
+    std::vector<std::thread> workers;
+    size_t busy = 0;
+    bool stopping = false;
+
+    void enqueue(const std::string& path) {
+        if (!seen.insert(path).second)
+            return;
+        modules[path].reset(new Loaded);
+        queue.push_back(path);
+    }
+
+    void work() {
+        PoolAllocator pool;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&] { return stopping || !queue.empty(); });
+            if (stopping)
+                return;
+            std::string path = queue.front();
+            queue.pop_front();
+            ++busy;
+            lock.unlock();
+            Loaded res = load(path);
+            lock.lock();
+            --busy;
+            for (auto& i : res.imports)
+                enqueue(i.first);
+            auto it = modules.find(path);
+            if (it != modules.end())
+                *it->second = std::move(res);
+            done.notify_all();
+            if (!queue.empty())
+                wake.notify_one();
+        }
+    }
+};
+
+#endif
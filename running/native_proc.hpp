@@ -130,7 +130,6 @@ OPL_BasicValue* val_conv(STACK_VALUE* value) {
 		default:
 			return nullptr;
 	}
-	new_obj->next = nullptr;
 	return new_obj;
 }
 
@@ -177,7 +176,7 @@ STACK_VALUE* append(std::vector<STACK_VALUE*> args) {
     if (target->obj->kind == BV_ARRAY) {
         ((OPL_Array*) target->obj)->elements.push_back(val_conv(value));
     } else if (target->obj->kind == BV_STRING) {
-        ((OPL_String*) target)->str += get_string(val_conv(value));
+        ((OPL_String*) target->obj)->str += get_string(val_conv(value));
     } else {
         printf("unknown type %d\n", target->obj->kind);
         exit(-1);
@@ -238,6 +237,12 @@ STACK_VALUE* length(std::vector<STACK_VALUE*> args) {
     }
 }
 
+// Marker only: the VM recognises this proc and writes an image of itself
+// to the given path, see snapshot.hpp. Anywhere else it is a no-op.
+STACK_VALUE* snapshot(std::vector<STACK_VALUE*> /*args*/) {
+    return VM_NUL;
+}
+
 const std::unordered_map<std::string, BUILD_IN_PROC*> builtins = {
     {"print", print},
     {"println", println},
@@ -249,7 +254,8 @@ const std::unordered_map<std::string, BUILD_IN_PROC*> builtins = {
     {"not_null", not_null},
     {"read_file", read_file},
     {"int2str", int2str},
-    {"pop_back", pop_back}
+    {"pop_back", pop_back},
+    {"snapshot", snapshot}
 };
 
 #endif
\ No newline at end of file
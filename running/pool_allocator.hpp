@@ -0,0 +1,206 @@
+#ifndef COPL_POOL_ALLOCATOR_HPP
+#define COPL_POOL_ALLOCATOR_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <new>
+#include <vector>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+// Slab allocator for VM heap values. Requests up to POOL_MAX_SMALL bytes are
+// rounded to a size class and served from a free list; each class carves its
+// blocks out of ARENA_SIZE arenas aligned to their own size, so the owning
+// arena (and through it the owning pool) is found by masking the address.
+// Bigger requests fall through to the global operator new.
+//
+// A VM owns one pool and installs it as the current one of its thread for
+// its lifetime; module loader threads do the same with pools of their own.
+// Values can outlive the VM that made them (a module call returning an array
+// to its caller), so a dying pool only frees its empty arenas; the others are
+// orphaned and released once their last block comes back.
+
+#define ARENA_SIZE (64 * 1024)
+#define POOL_MAX_SMALL 256
+
+static const uint16_t pool_class_sizes[] = { 16, 32, 48, 64, 96, 128, 192, 256 };
+#define POOL_CLASS_COUNT (sizeof(pool_class_sizes) / sizeof(pool_class_sizes[0]))
+
+struct PoolAllocator;
+
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+struct Arena {
+    PoolAllocator* owner;
+    uint32_t live;
+    uint8_t size_class;
+};
+
+// The arena header is padded so blocks start 16-byte aligned.
+#define ARENA_HEADER ((sizeof(Arena) + 15) & ~(size_t)15)
+
+struct PoolClassStats {
+    size_t allocs = 0;
+    size_t frees = 0;
+    size_t live = 0;
+    size_t peak = 0;
+    size_t arenas = 0;
+};
+
+struct PoolAllocator {
+    PoolAllocator() : previous(current_slot()) { current_slot() = this; }
+
+    ~PoolAllocator() {
+        if (current_slot() == this)
+            current_slot() = previous;
+        for (auto a : arenas) {
+            if (a->live == 0)
+                free_arena(a);
+            else
+                a->owner = nullptr;
+        }
+    }
+
+    PoolAllocator(const PoolAllocator&) = delete;
+    PoolAllocator& operator=(const PoolAllocator&) = delete;
+
+    static PoolAllocator* current() {
+        PoolAllocator* p = current_slot();
+        return p ? p : &global();
+    }
+
+    // Values built before any VM runs (compiler constants, loaded chunks)
+    // land here.
+    static PoolAllocator& global() {
+        static PoolAllocator* g = new PoolAllocator(0);
+        return *g;
+    }
+
+    static inline size_t class_of(size_t size) {
+        return size <= 16 ? 0 : size <= 32 ? 1 : size <= 48 ? 2 : size <= 64 ? 3
+             : size <= 96 ? 4 : size <= 128 ? 5 : size <= 192 ? 6 : 7;
+    }
+
+    void* allocate(size_t size) {
+        if (size > POOL_MAX_SMALL) {
+            large_allocs++;
+            return ::operator new(size);
+        }
+        size_t c = class_of(size);
+        FreeBlock* b = free_lists[c];
+        if (!b)
+            b = refill(c);
+        free_lists[c] = b->next;
+        arena_of(b)->live++;
+        PoolClassStats& s = stats[c];
+        s.allocs++;
+        if (++s.live > s.peak)
+            s.peak = s.live;
+        return b;
+    }
+
+    static void release(void* p, size_t size) {
+        if (!p)
+            return;
+        if (size > POOL_MAX_SMALL) {
+            ::operator delete(p);
+            return;
+        }
+        Arena* a = arena_of(p);
+        a->live--;
+        if (a->owner) {
+            a->owner->push_free(a->size_class, p);
+        } else if (a->live == 0) {
+            free_arena(a);
+        }
+    }
+
+    void dump_stats(FILE* out = stdout) const {
+        fprintf(out, "%-8s %10s %10s %10s %10s %8s\n", "class", "allocs", "frees", "live", "peak", "arenas");
+        for (size_t c = 0; c < POOL_CLASS_COUNT; c++) {
+            const PoolClassStats& s = stats[c];
+            if (s.allocs == 0)
+                continue;
+            fprintf(out, "%-8u %10zu %10zu %10zu %10zu %8zu\n", pool_class_sizes[c], s.allocs, s.frees, s.live, s.peak, s.arenas);
+        }
+        fprintf(out, "large    %10zu\n", large_allocs);
+    }
+
+    // For the collector: every arena holds blocks of a single class, so the
+    // live blocks can be walked from this list.
+    const std::vector<Arena*>& get_arenas() const { return arenas; }
+
+    PoolClassStats stats[POOL_CLASS_COUNT];
+    size_t large_allocs = 0;
+
+private:
+    // Only used for the global pool, which must not become the current one.
+    explicit PoolAllocator(int) : previous(nullptr) {}
+
+    static PoolAllocator*& current_slot() {
+        static thread_local PoolAllocator* slot = nullptr;
+        return slot;
+    }
+
+    static inline Arena* arena_of(void* p) {
+        return (Arena*)((uintptr_t)p & ~(uintptr_t)(ARENA_SIZE - 1));
+    }
+
+    void push_free(uint8_t c, void* p) {
+        FreeBlock* b = (FreeBlock*)p;
+        b->next = free_lists[c];
+        free_lists[c] = b;
+        stats[c].frees++;
+        stats[c].live--;
+    }
+
+    FreeBlock* refill(size_t c) {
+        Arena* a = (Arena*)alloc_arena();
+        a->owner = this;
+        a->live = 0;
+        a->size_class = (uint8_t)c;
+        arenas.push_back(a);
+        stats[c].arenas++;
+
+        size_t block = pool_class_sizes[c];
+        size_t count = (ARENA_SIZE - ARENA_HEADER) / block;
+        char* begin = (char*)a + ARENA_HEADER;
+        FreeBlock* head = nullptr;
+        for (size_t n = count; n-- > 0;) {
+            FreeBlock* b = (FreeBlock*)(begin + n * block);
+            b->next = head;
+            head = b;
+        }
+        return head;
+    }
+
+    static void* alloc_arena() {
+#ifdef _WIN32
+        void* p = _aligned_malloc(ARENA_SIZE, ARENA_SIZE);
+#else
+        void* p = std::aligned_alloc(ARENA_SIZE, ARENA_SIZE);
+#endif
+        if (!p)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    static void free_arena(Arena* a) {
+#ifdef _WIN32
+        _aligned_free(a);
+#else
+        std::free(a);
+#endif
+    }
+
+    FreeBlock* free_lists[POOL_CLASS_COUNT] = {};
+    std::vector<Arena*> arenas;
+    PoolAllocator* previous;
+};
+
+#endif
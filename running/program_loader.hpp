@@ -2,167 +2,402 @@
 #define COPL_PROGRAM_LOADER_HPP
 
 #include "value.hpp"
-#include "..\resfile_types.hpp"
+#include "../resfile_types.hpp"
 #include <cstdint>
+#include <cstring>
 #include <string>
 #include <vector>
 #include <unordered_map>
 #include <cstdio>
+#include <mutex>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-std::vector<Frame*> load_bytecode(const std::string& filename,
-                                   const std::unordered_map<std::string, BUILD_IN_PROC*>& builtins) {
-    FILE* file = fopen(filename.c_str(), "rb");
-    if (!file) {
-        printf("Cannot open bytecode file: %s\n", filename.c_str());
-        exit(-1);
+// A .copl file mapped copy-on-write. Compact chunks run their code straight
+// out of the mapping, quickening only dirties the pages it touches and v3
+// bodies are decoded from it on demand, so mappings are kept for the life
+// of the process.
+struct MappedFile {
+    char* data = nullptr;
+    size_t size = 0;
+
+    bool open(const std::string& filename) {
+#ifdef _WIN32
+        HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER len;
+        GetFileSizeEx(file, &len);
+        size = (size_t)len.QuadPart;
+        HANDLE mapping = size ? CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr) : nullptr;
+        if (mapping) {
+            data = (char*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+#else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        fstat(fd, &st);
+        size = (size_t)st.st_size;
+        if (size) {
+            void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            data = (p == MAP_FAILED) ? nullptr : (char*)p;
+        }
+        ::close(fd);
+#endif
+        return data != nullptr;
     }
 
-    uint32_t magic;
-    fread(&magic, sizeof(magic), 1, file);
-    if (magic != 0xC0001) {
-        printf("Invalid bytecode file (magic mismatch)\n");
-        fclose(file);
+    static std::vector<MappedFile*>& live() {
+        static std::vector<MappedFile*> files;
+        return files;
+    }
+};
+
+// Reads both layouts: v1 stores every integer as a 32-bit word, v2 stores
+// counts and lengths as varints and ints zigzag encoded.
+struct ByteReader {
+    char* p;
+    char* end;
+    bool compact = false;
+    bool lenient = false;
+    bool failed = false;
+
+    template <typename T>
+    T read() {
+        T v{};
+        if (p + sizeof(T) > end) {
+            truncated();
+            return v;
+        }
+        memcpy(&v, p, sizeof(T));
+        p += sizeof(T);
+        return v;
+    }
+
+    uint32_t read_varint() {
+        uint32_t v = 0;
+        for (int shift = 0; shift < 35; shift += 7) {
+            uint8_t b = read<uint8_t>();
+            v |= (uint32_t)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+                return v;
+        }
+        truncated();
+        return 0;
+    }
+
+    uint32_t count() { return compact ? read_varint() : read<uint32_t>(); }
+
+    // A count of items that take at least a byte each, so one larger than
+    // what is left cannot be right.
+    uint32_t bounded_count() {
+        uint32_t n = count();
+        if (n > (size_t)(end - p)) {
+            truncated();
+            return 0;
+        }
+        return n;
+    }
+
+    int32_t sint() { return compact ? unzigzag(read_varint()) : read<int32_t>(); }
+
+    char* take(size_t len) {
+        if (len > (size_t)(end - p)) {
+            truncated();
+            return nullptr;
+        }
+        char* at = p;
+        p += len;
+        return at;
+    }
+
+    std::string read_string() {
+        uint32_t len = count();
+        char* at = take(len);
+        return at ? std::string(at, len) : std::string();
+    }
+
+    inline bool at_end() const { return p >= end; }
+
+    // A lenient reader, for data that can just be thrown away, only records
+    // the failure and reads nothing more.
+    void truncated() {
+        if (lenient) {
+            failed = true;
+            p = end;
+            return;
+        }
+        printf("Invalid bytecode file (truncated)\n");
         exit(-1);
     }
+};
 
-    uint32_t func_cnt;
-    fread(&func_cnt, sizeof(func_cnt), 1, file);
+// A constant as write_value stores it.
+STACK_VALUE* read_value(ByteReader& in) {
+    switch (in.read<uint8_t>()) {
+        case BINT:    return STACK_VALUE::make_int(in.sint());
+        case BFLOAT:  return STACK_VALUE::make_double(in.read<double>());
+        case BSTRING: return STACK_VALUE::make_str(in.read_string());
+        case BBOOL:   return STACK_VALUE::make_bool(in.read<uint8_t>() != 0);
+        case BNULL:
+        default:      return STACK_VALUE::make_null();
+    }
+}
 
-    std::vector<Frame*> frames;
-    frames.reserve(func_cnt);
+// Code, names and constants of one function.
+void read_body(ByteReader& in, Chunk* chunk) {
+    uint32_t code_size = in.count();
+    char* code_at = in.take(in.compact ? code_size : (size_t)code_size * sizeof(int32_t));
+    if (in.compact) {
+        chunk->mapped_code = (uint8_t*)code_at;
+        chunk->mapped_size = code_size;
+    } else {
+        chunk->op_codes.resize(code_size);
+        memcpy(chunk->op_codes.data(), code_at, (size_t)code_size * sizeof(int32_t));
+    }
 
-    for (uint32_t t_i = 0; t_i < func_cnt; ++t_i) {
-        uint32_t name_len;
-        fread(&name_len, sizeof(name_len), 1, file);
-        std::string func_name(name_len, '\0');
-        fread(&func_name[0], 1, name_len, file);
-
-        int32_t func_id, args_len;
-        fread(&func_id, sizeof(func_id), 1, file);
-        fread(&args_len, sizeof(args_len), 1, file);
-     
-        uint32_t code_size;
-        fread(&code_size, sizeof(code_size), 1, file);
-
-        auto it = builtins.find(func_name);
-        bool is_builtin = (it != builtins.end());
-
-        std::vector<int> op_codes;
-        if (!is_builtin && code_size > 0) {
-            op_codes.resize(code_size);
-            for (uint32_t j = 0; j < code_size; ++j) {
-                int32_t op;
-                fread(&op, sizeof(op), 1, file);
-                op_codes[j] = op;
-            }
-        } else {
-            fseek(file, code_size * sizeof(int32_t), SEEK_CUR);
+    uint32_t name_count = in.count();
+    chunk->names.reserve(name_count);
+    for (uint32_t j = 0; j < name_count; ++j)
+        chunk->names.push_back(in.read_string());
+
+    uint32_t const_count = in.count();
+    chunk->const_pool.reserve(const_count);
+    for (uint32_t j = 0; j < const_count; ++j)
+        chunk->const_pool.push_back(read_value(in));
+
+    // v1 code is one word per opcode and operand, re-encode it.
+    if (!in.compact)
+        chunk->encode();
+}
+
+void skip_body(ByteReader& in) {
+    uint32_t code_size = in.count();
+    in.take(in.compact ? code_size : (size_t)code_size * sizeof(int32_t));
+    uint32_t name_count = in.count();
+    for (uint32_t j = 0; j < name_count; ++j)
+        in.take(in.count());
+    uint32_t const_count = in.count();
+    for (uint32_t j = 0; j < const_count; ++j) {
+        switch (in.read<uint8_t>()) {
+            case BINT:    in.sint(); break;
+            case BFLOAT:  in.take(sizeof(double)); break;
+            case BSTRING: in.take(in.count()); break;
+            case BBOOL:   in.take(1); break;
+            default:      break;
         }
+    }
+}
 
-        uint32_t name_count;
-        fread(&name_count, sizeof(name_count), 1, file);
-        std::vector<std::string> names;
-        if (!is_builtin && name_count > 0) {
-            names.resize(name_count);
-            for (uint32_t j = 0; j < name_count; ++j) {
-                uint32_t len;
-                fread(&len, sizeof(len), 1, file);
-                std::string str(len, '\0');
-                fread(&str[0], 1, len, file);
-                names[j] = std::move(str);
-            }
-        } else {
-            for (uint32_t j = 0; j < name_count; ++j) {
-                uint32_t len;
-                fread(&len, sizeof(len), 1, file);
-                fseek(file, len, SEEK_CUR);
+void read_lazy_body(Chunk* chunk) {
+    ByteReader in { chunk->lazy_body, chunk->lazy_body + chunk->lazy_size, true };
+    chunk->lazy_loader = nullptr;
+    read_body(in, chunk);
+}
+
+void read_shapes(ByteReader& in, std::vector<ObjectShape*>* shapes) {
+    uint32_t shape_cnt = in.count();
+    std::vector<std::vector<int32_t>> base_ids(shape_cnt);
+    for (uint32_t j = 0; j < shape_cnt; ++j) {
+        ObjectShape* shape = new ObjectShape;
+        shape->name = in.read_string();
+        uint32_t base_cnt = in.count();
+        for (uint32_t k = 0; k < base_cnt; ++k)
+            base_ids[j].push_back((int32_t)in.count());
+        uint32_t member_cnt = in.count();
+        shape->members.reserve(member_cnt);
+        for (uint32_t k = 0; k < member_cnt; ++k)
+            shape->members.push_back(in.read_string());
+        shapes->push_back(shape);
+    }
+    for (uint32_t j = 0; j < shape_cnt; ++j)
+        for (auto id : base_ids[j]) {
+            if ((uint32_t)id >= shape_cnt) {
+                printf("Invalid bytecode file (bad base class %d)\n", id);
+                exit(-1);
             }
+            (*shapes)[j]->bases.push_back((*shapes)[id]);
         }
+}
 
-        uint32_t const_count;
-        fread(&const_count, sizeof(const_count), 1, file);
-        std::vector<STACK_VALUE*> const_pool;
-        if (!is_builtin && const_count > 0) {
-            const_pool.resize(const_count);
-            for (uint32_t j = 0; j < const_count; ++j) {
-                uint8_t type;
-                fread(&type, 1, 1, file);
-                STACK_VALUE* val = nullptr;
-                switch (type) {
-                    case BINT: {
-                        int32_t i;
-                        fread(&i, sizeof(i), 1, file);
-                        val = STACK_VALUE::make_int(i);
-                        break;
-                    }
-                    case BFLOAT: {
-                        double d;
-                        fread(&d, sizeof(d), 1, file);
-                        val = STACK_VALUE::make_double(d);
-                        break;
-                    }
-                    case BSTRING: {
-                        uint32_t len;
-                        fread(&len, sizeof(len), 1, file);
-                        std::string s(len, '\0');
-                        fread(&s[0], 1, len, file);
-                        val = STACK_VALUE::make_str(s);
-                        break;
-                    }
-                    case BBOOL: {
-                        uint8_t b;
-                        fread(&b, 1, 1, file);
-                        val = STACK_VALUE::make_bool(b != 0);
-                        break;
-                    }
-                    case BNULL:
-                    default:
-                        val = STACK_VALUE::make_null();
-                        break;
-                }
-                const_pool[j] = val;
-            }
-        } else {
-            for (uint32_t j = 0; j < const_count; ++j) {
-                uint8_t type;
-                fread(&type, 1, 1, file);
-                switch (type) {
-                    case BINT:    fseek(file, sizeof(int32_t), SEEK_CUR); break;
-                    case BFLOAT:  fseek(file, sizeof(double), SEEK_CUR); break;
-                    case BSTRING: {
-                        uint32_t len;
-                        fread(&len, sizeof(len), 1, file);
-                        fseek(file, len, SEEK_CUR);
-                        break;
-                    }
-                    case BBOOL:   fseek(file, 1, SEEK_CUR); break;
-                    case BNULL:   break;
-                    default:       break;
-                }
-            }
+Frame* make_frame(const std::unordered_map<std::string, BUILD_IN_PROC*>& builtins,
+                  const std::string& func_name, int32_t func_id, int32_t args_len, Chunk** chunk) {
+    Frame* frame;
+    auto it = builtins.find(func_name);
+    if (it != builtins.end()) {
+        frame = new Frame(it->second, func_name);
+        *chunk = nullptr;
+    } else {
+        *chunk = new Chunk;
+        frame = new Frame(*chunk);
+        frame->func_name = func_name;
+    }
+    frame->func_id = func_id;
+    frame->args_len = args_len;
+    return frame;
+}
+
+// The modules a file written before v4 imports, read from the
+// OP_LOAD_MODULE <path> <name> instructions its main starts with. Only a
+// program has a main, so a module's imports are not found this way.
+std::vector<ImportRef> scan_imports(const std::vector<Frame*>& funcs) {
+    std::vector<ImportRef> imports;
+    Frame* main = nullptr;
+    for (auto f : funcs)
+        if (!f->is_build_in && f->func_name == "main")
+            main = f;
+    if (!main)
+        return imports;
+    Chunk* chunk = main->codes;
+    chunk->ensure_loaded();
+    uint8_t* p = chunk->code();
+    uint8_t* end = p + chunk->code_size();
+    while (p < end) {
+        int op = *p++;
+        if (op >= instruction_count)
+            break;
+        int args[2] = {0, 0};
+        for (int k = 0; k < instruction_info[op].arg_count; ++k)
+            args[k] = read_varint(p);
+        if (op == OP_LOAD_MODULE)
+            imports.emplace_back(chunk->const_pool[args[0]]->str_value, chunk->const_pool[args[1]]->str_value);
+    }
+    return imports;
+}
+
+void read_imports(ByteReader& in, std::vector<ImportRef>* imports) {
+    uint32_t import_cnt = in.count();
+    for (uint32_t k = 0; k < import_cnt; ++k) {
+        std::string path = in.read_string();
+        imports->emplace_back(path, in.read_string());
+    }
+}
+
+// v3 and v4: only the index is read here, each body is decoded on its
+// first call.
+std::vector<Frame*> load_indexed(ByteReader& in, char* base, uint32_t version,
+                                 const std::unordered_map<std::string, BUILD_IN_PROC*>& builtins,
+                                 std::vector<ObjectShape*>* shapes, std::vector<ImportRef>* imports) {
+    uint32_t func_cnt = in.read<uint32_t>();
+    uint32_t shapes_at = in.read<uint32_t>();
+    uint32_t imports_at = (version >= 4) ? in.read<uint32_t>() : 0;
+    // Offsets come from the file; one past its end would leave a reader
+    // with `p` beyond `end`, which take() cannot catch.
+    auto at = [&](uint32_t offset, bool compact) {
+        if (offset > (size_t)(in.end - base))
+            in.truncated();
+        return ByteReader { base + offset, in.end, compact };
+    };
+    std::vector<Frame*> frames;
+    frames.reserve(func_cnt);
+    for (uint32_t t_i = 0; t_i < func_cnt; ++t_i) {
+        FuncIndexEntry e = in.read<FuncIndexEntry>();
+        ByteReader name = at(e.name_offset, false);
+        ByteReader body = at(e.body_offset, true);
+        std::string func_name(name.take(e.name_len), e.name_len);
+        body.take(e.body_len);
+
+        Chunk* chunk;
+        Frame* frame = make_frame(builtins, func_name, e.id, e.args_len, &chunk);
+        if (chunk && e.body_len) {
+            chunk->lazy_loader = &read_lazy_body;
+            chunk->lazy_body = base + e.body_offset;
+            chunk->lazy_size = e.body_len;
         }
+        frames.push_back(frame);
+    }
+    if (shapes && shapes_at) {
+        ByteReader table = at(shapes_at, true);
+        read_shapes(table, shapes);
+    }
+    if (imports && imports_at) {
+        ByteReader table = at(imports_at, true);
+        read_imports(table, imports);
+    } else if (imports) {
+        *imports = scan_imports(frames);
+    }
+    return frames;
+}
+
+MappedFile* map_file(const std::string& filename) {
+    MappedFile* file = new MappedFile;
+    if (!file->open(filename)) {
+        printf("Cannot open bytecode file: %s\n", filename.c_str());
+        exit(-1);
+    }
+    static std::mutex live_lock;
+    std::lock_guard<std::mutex> lock(live_lock);
+    MappedFile::live().push_back(file);
+    return file;
+}
+
+// Decodes a program from memory that stays valid for the rest of the run.
+std::vector<Frame*> load_program(char* data, size_t size,
+                                 const std::unordered_map<std::string, BUILD_IN_PROC*>& builtins,
+                                 std::vector<ObjectShape*>* shapes = nullptr,
+                                 std::vector<ImportRef>* imports = nullptr) {
+    ByteReader in { data, data + size };
 
-        Frame* frame = nullptr;
-        if (is_builtin) {
-            frame = new Frame(it->second, func_name);
-            frame->func_id = func_id;
-            frame->args_len = args_len;
-        } else {
-            Chunk* chunk = new Chunk;
-            chunk->op_codes = std::move(op_codes);
-            chunk->names = std::move(names);
-            chunk->const_pool = std::move(const_pool);
-            frame = new Frame(chunk);
-            frame->func_name = func_name;
-            frame->func_id = func_id;
-            frame->args_len = args_len;
+    uint32_t magic = in.read<uint32_t>();
+    if (magic == COPL_MAGIC) {
+        uint32_t version = in.read<uint32_t>();
+        if (version == 3 || version == COPL_VERSION)
+            return load_indexed(in, data, version, builtins, shapes, imports);
+        if (version != 2) {
+            printf("Unsupported bytecode version %u\n", version);
+            exit(-1);
         }
+        in.compact = true;
+    } else if (magic != COPL_MAGIC_V1) {
+        printf("Invalid bytecode file (magic mismatch)\n");
+        exit(-1);
+    }
 
+    // v1 and v2 list the functions one after another.
+    uint32_t func_cnt = in.count();
+    std::vector<Frame*> frames;
+    frames.reserve(func_cnt);
+    for (uint32_t t_i = 0; t_i < func_cnt; ++t_i) {
+        std::string func_name = in.read_string();
+        int32_t func_id = in.sint();
+        int32_t args_len = (int32_t)in.count();
+        Chunk* chunk;
+        Frame* frame = make_frame(builtins, func_name, func_id, args_len, &chunk);
+        if (chunk)
+            read_body(in, chunk);
+        else
+            skip_body(in);
         frames.push_back(frame);
     }
 
-    fclose(file);
+    // Class table, absent in files written before shapes were recorded.
+    if (shapes && !in.at_end())
+        read_shapes(in, shapes);
+    if (imports)
+        *imports = scan_imports(frames);
+
     return frames;
 }
 
-#endif 
\ No newline at end of file
+std::vector<Frame*> load_bytecode(const std::string& filename,
+                                   const std::unordered_map<std::string, BUILD_IN_PROC*>& builtins,
+                                   std::vector<ObjectShape*>* shapes = nullptr,
+                                   std::vector<ImportRef>* imports = nullptr) {
+    MappedFile* file = map_file(filename);
+    return load_program(file->data, file->size, builtins, shapes, imports);
+}
+
+#endif
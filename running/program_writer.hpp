@@ -0,0 +1,256 @@
+#ifndef COPL_PROGRAM_WRITER_HPP
+#define COPL_PROGRAM_WRITER_HPP
+
+#include "value.hpp"
+#include "../resfile_types.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+// The file is assembled in memory: the function index at the front needs
+// the offsets of the bodies that follow it.
+typedef std::string CodeBuffer;
+
+void write_bytes(CodeBuffer& out, const void* data, size_t len) {
+    out.append((const char*)data, len);
+}
+
+void write_u32(CodeBuffer& out, uint32_t v) { write_bytes(out, &v, sizeof(v)); }
+
+void write_varint(CodeBuffer& out, uint32_t v) {
+    uint8_t buf[5];
+    int width = varint_width(v);
+    write_varint(buf, v, width);
+    write_bytes(out, buf, width);
+}
+
+void write_string(CodeBuffer& out, const std::string& str) {
+    write_varint(out, str.size());
+    write_bytes(out, str.c_str(), str.size());
+}
+
+void write_tag(CodeBuffer& out, CT type) { out.push_back((char)type); }
+
+void write_value(CodeBuffer& out, STACK_VALUE* value) {
+    OPL_BasicValue* obj = (value && value->is_heap_ref) ? value->obj : nullptr;
+    if (!value || (value->is_heap_ref && !obj)) {
+        write_tag(out, BNULL);
+    } else if (obj) {
+        switch (obj->kind) {
+            case BV_INT:    write_tag(out, BINT); write_varint(out, zigzag(((OPL_Integer*)obj)->i)); break;
+            case BV_FLOAT:  write_tag(out, BFLOAT); write_bytes(out, &((OPL_Float*)obj)->f, sizeof(double)); break;
+            case BV_STRING: write_tag(out, BSTRING); write_string(out, ((OPL_String*)obj)->str); break;
+            case BV_BOOL:   write_tag(out, BBOOL); out.push_back(((OPL_Bool*)obj)->b ? 1 : 0); break;
+            default:        write_tag(out, BNULL); break;
+        }
+    } else {
+        switch (value->kind) {
+            case STACK_VALUE::S_INT:    write_tag(out, BINT); write_varint(out, zigzag(value->i_val)); break;
+            case STACK_VALUE::S_DOUBLE: write_tag(out, BFLOAT); write_bytes(out, &value->d_val, sizeof(double)); break;
+            case STACK_VALUE::S_STR:    write_tag(out, BSTRING); write_string(out, value->str_value); break;
+            case STACK_VALUE::S_BOOL:   write_tag(out, BBOOL); out.push_back(value->b_val ? 1 : 0); break;
+            default:                    write_tag(out, BNULL); break;
+        }
+    }
+}
+
+// Inline caches are runtime state: write sites that already quickened
+// back in their generic form. The operands keep their width.
+void unquicken(Chunk* chunk, uint8_t* code) {
+    uint8_t* p = code;
+    uint8_t* end = code + chunk->code_size();
+    while (p < end) {
+        uint8_t* site = p;
+        int op = *p++;
+        for (int k = 0; k < instruction_info[op].arg_count; ++k)
+            read_varint(p);
+        if (op != OP_MEMBER_GET_IC && op != OP_MEMBER_SET_IC && op != OP_INVOKE_IC
+            && op != OP_LOAD_MODULE_METHOD_IC && op != OP_CALL_MODULE_IC)
+            continue;
+        uint8_t* operand = site + 1;
+        const InlineCache& ic = chunk->inline_caches[read_varint(operand)];
+        if (op == OP_LOAD_MODULE_METHOD_IC || op == OP_CALL_MODULE_IC) {
+            site[0] = OP_LOAD_MODULE_METHOD;
+            patch_varint(site + 1, ic.origin);
+        } else if (op == OP_INVOKE_IC) {
+            int member = -1;
+            for (size_t c = 0; c < chunk->const_pool.size() && member < 0; ++c) {
+                STACK_VALUE* v = chunk->const_pool[c];
+                if (!v->is_heap_ref && v->kind == STACK_VALUE::S_STR && v->str_value == ic.member)
+                    member = (int)c;
+            }
+            site[0] = OP_INVOKE;
+            patch_varint(site + 1, member);
+        } else {
+            site[0] = (op == OP_MEMBER_GET_IC) ? OP_MEMBER_GET : OP_MEMBER_SET;
+            patch_varint(site + 1, ic.origin);
+        }
+    }
+}
+
+// Functions reachable from `roots` through OP_CALL, OP_LOAD_FUNC_ADDR and
+// method invocations, in their original order. Methods are bound by name at
+// run time, so invoking `m` anywhere keeps every class's `m`. Calls into
+// other modules (OP_LOAD_MODULE_METHOD) name functions of another file and
+// need nothing kept here; the ids of the functions that remain do not
+// change.
+std::vector<Frame*> reachable_functions(const std::vector<Frame*>& funcs, const std::vector<Frame*>& roots) {
+    std::unordered_map<int, Frame*> by_id;
+    std::unordered_map<std::string, std::vector<Frame*>> methods;
+    for (auto f : funcs) {
+        by_id[f->func_id] = f;
+        size_t sep = f->func_name.find('$');
+        if (sep != std::string::npos)
+            methods[f->func_name.substr(sep + 1)].push_back(f);
+    }
+
+    std::unordered_set<Frame*> keep;
+    std::vector<Frame*> work;
+    auto mark = [&](Frame* f) {
+        if (f && keep.insert(f).second)
+            work.push_back(f);
+    };
+    for (auto r : roots)
+        mark(r);
+    while (!work.empty()) {
+        Frame* f = work.back();
+        work.pop_back();
+        if (f->is_build_in)
+            continue;
+        Chunk* chunk = f->codes;
+        chunk->ensure_loaded();
+        uint8_t* p = chunk->code();
+        uint8_t* end = p + chunk->code_size();
+        while (p < end) {
+            int op = *p++;
+            int args[2] = {0, 0};
+            for (int k = 0; k < instruction_info[op].arg_count; ++k)
+                args[k] = read_varint(p);
+            std::string method;
+            if (op == OP_CALL || op == OP_LOAD_FUNC_ADDR) {
+                auto it = by_id.find(args[0]);
+                if (it != by_id.end())
+                    mark(it->second);
+            } else if (op == OP_INVOKE) {
+                method = chunk->const_pool[args[0]]->str_value;
+            } else if (op == OP_INVOKE_IC) {
+                method = chunk->inline_caches[args[0]].member;
+            }
+            if (!method.empty())
+                for (auto m : methods[method])
+                    mark(m);
+        }
+    }
+
+    std::vector<Frame*> res;
+    for (auto f : funcs)
+        if (keep.count(f))
+            res.push_back(f);
+    return res;
+}
+
+// An entry program only needs what main reaches. A file that may be
+// imported also keeps every top-level function, since importers call them
+// by name.
+std::vector<Frame*> shake_program(const std::vector<Frame*>& funcs, bool is_entry) {
+    std::vector<Frame*> roots;
+    for (auto f : funcs) {
+        if (f->is_build_in)
+            continue;
+        if (f->func_name == "main" || (!is_entry && !f->is_lambda && f->func_name.find('$') == std::string::npos))
+            roots.push_back(f);
+    }
+    if (is_entry && roots.empty())
+        return funcs;
+    return reachable_functions(funcs, roots);
+}
+
+// Body of a function: code, names and constants. Builtins have none.
+void write_body(CodeBuffer& out, Frame* func) {
+    if (func->is_build_in)
+        return;
+    Chunk* chunk = func->codes;
+    chunk->ensure_loaded();
+    write_varint(out, chunk->code_size());
+    size_t code_at = out.size();
+    write_bytes(out, chunk->code(), chunk->code_size());
+    unquicken(chunk, (uint8_t*)&out[code_at]);
+    write_varint(out, chunk->names.size());
+    for (const auto& n : chunk->names)
+        write_string(out, n);
+    write_varint(out, chunk->const_pool.size());
+    for (auto val : chunk->const_pool)
+        write_value(out, val);
+}
+
+void write_shapes(CodeBuffer& out, const std::vector<ObjectShape*>& shapes) {
+    write_varint(out, shapes.size());
+    for (auto shape : shapes) {
+        write_string(out, shape->name);
+        write_varint(out, shape->bases.size());
+        for (auto base : shape->bases)
+            write_varint(out, std::find(shapes.begin(), shapes.end(), base) - shapes.begin());
+        write_varint(out, shape->members.size());
+        for (const auto& m : shape->members)
+            write_string(out, m);
+    }
+}
+
+void write_imports(CodeBuffer& out, const std::vector<ImportRef>& imports) {
+    write_varint(out, imports.size());
+    for (auto& i : imports) {
+        write_string(out, i.first);
+        write_string(out, i.second);
+    }
+}
+
+// v4 layout: header, function index, names, bodies, class table, import
+// table. The index has fixed-size entries so the loader can reach any
+// function directly.
+CodeBuffer build_program(const std::vector<Frame*>& funcs, const std::vector<ObjectShape*>& shape_table,
+                         const std::vector<ImportRef>& import_table = {}) {
+    CodeBuffer names, bodies, shapes, imports;
+    std::vector<FuncIndexEntry> index;
+    for (auto frame : funcs) {
+        FuncIndexEntry e;
+        e.id = frame->func_id;
+        e.args_len = frame->args_len;
+        e.name_offset = names.size();
+        e.name_len = frame->func_name.size();
+        write_bytes(names, frame->func_name.c_str(), frame->func_name.size());
+        e.body_offset = bodies.size();
+        write_body(bodies, frame);
+        e.body_len = bodies.size() - e.body_offset;
+        index.push_back(e);
+    }
+    write_shapes(shapes, shape_table);
+    write_imports(imports, import_table);
+
+    uint32_t names_at = COPL_HEADER_SIZE + index.size() * sizeof(FuncIndexEntry);
+    uint32_t bodies_at = names_at + names.size();
+    uint32_t shapes_at = bodies_at + bodies.size();
+    uint32_t imports_at = shapes_at + shapes.size();
+    CodeBuffer out;
+    write_u32(out, COPL_MAGIC);
+    write_u32(out, COPL_VERSION);
+    write_u32(out, index.size());
+    write_u32(out, shapes_at);
+    write_u32(out, imports_at);
+    for (auto& e : index) {
+        e.name_offset += names_at;
+        e.body_offset += bodies_at;
+        write_bytes(out, &e, sizeof(e));
+    }
+    out += names;
+    out += bodies;
+    out += shapes;
+    out += imports;
+    return out;
+}
+
+
+#endif
@@ -0,0 +1,391 @@
+#ifndef COPL_SNAPSHOT_HPP
+#define COPL_SNAPSHOT_HPP
+
+#include "vm.hpp"
+#include "program_writer.hpp"
+#include "program_loader.hpp"
+
+// Image written by the snapshot() builtin and resumed by VM(path):
+//
+//   u32 COPL_IMAGE_MAGIC, u32 COPL_IMAGE_VERSION
+//   u32 length + the program as a v3 .copl (sites unquickened)
+//   modules:  name, path              (reloaded from their .copl files)
+//   objects:  heap values, references by index + 1, 0 for null
+//   values:   stack values
+//   globals:  name, value
+//   calls:    function, pc offset, operand stack, locals; bottom first
+//
+// Functions and shapes are referred to by unit and index, unit 0 being the
+// program itself and unit n the n-th loaded module.
+
+struct ImageUnit {
+    std::vector<Frame*>* funcs;
+    std::vector<ObjectShape*>* shapes;
+};
+
+struct ImageWriter {
+    VM* vm;
+    std::vector<ImageUnit> units;
+    std::unordered_map<Chunk*, std::pair<int, int>> chunk_ref;
+    std::unordered_map<BUILD_IN_PROC*, std::pair<int, int>> proc_ref;
+    std::unordered_map<ObjectShape*, std::pair<int, int>> shape_ref;
+    std::unordered_map<OPL_BasicValue*, int> object_ids;
+    std::unordered_map<STACK_VALUE*, int> value_ids;
+    std::vector<OPL_BasicValue*> objects;
+    std::vector<STACK_VALUE*> values;
+
+    explicit ImageWriter(VM* vm) : vm(vm) {
+        units.push_back({&vm->frames, &vm->shapes});
+        for (auto m : vm->modules)
+            units.push_back({&m->funcs, &m->shapes});
+        for (size_t u = 0; u < units.size(); ++u) {
+            for (size_t f = 0; f < units[u].funcs->size(); ++f) {
+                Frame* frame = (*units[u].funcs)[f];
+                if (frame->is_build_in) proc_ref.emplace(frame->proc, std::make_pair(u, f));
+                else chunk_ref.emplace(frame->codes, std::make_pair(u, f));
+            }
+            for (size_t k = 0; k < units[u].shapes->size(); ++k)
+                shape_ref.emplace((*units[u].shapes)[k], std::make_pair(u, k));
+        }
+    }
+
+    void write_ref(CodeBuffer& out, std::pair<int, int> ref) {
+        write_varint(out, ref.first);
+        write_varint(out, ref.second);
+    }
+
+    void write_func(CodeBuffer& out, void* pointer) {
+        Frame* f = (Frame*)pointer;
+        auto ref = std::make_pair(-1, -1);
+        if (f && f->is_build_in && proc_ref.count(f->proc)) ref = proc_ref[f->proc];
+        else if (f && !f->is_build_in && chunk_ref.count(f->codes)) ref = chunk_ref[f->codes];
+        if (ref.first < 0) {
+            printf("SnapshotError: cannot save a raw pointer\n");
+            exit(-1);
+        }
+        write_ref(out, ref);
+    }
+
+    int object_id(OPL_BasicValue* obj) {
+        if (!obj)
+            return 0;
+        auto it = object_ids.find(obj);
+        if (it != object_ids.end())
+            return it->second;
+        objects.push_back(obj);
+        return object_ids[obj] = objects.size();
+    }
+
+    int value_id(STACK_VALUE* value) {
+        if (!value)
+            return 0;
+        auto it = value_ids.find(value);
+        if (it != value_ids.end())
+            return it->second;
+        values.push_back(value);
+        return value_ids[value] = values.size();
+    }
+
+    // Ids are handed out as references are met; the object table grows
+    // while it is being written, which walks the graph breadth first.
+    void write_object(CodeBuffer& out, OPL_BasicValue* obj) {
+        out.push_back((char)obj->kind);
+        switch (obj->kind) {
+            case BV_INT:    write_varint(out, zigzag(((OPL_Integer*)obj)->i)); break;
+            case BV_FLOAT:  write_bytes(out, &((OPL_Float*)obj)->f, sizeof(double)); break;
+            case BV_STRING: write_string(out, ((OPL_String*)obj)->str); break;
+            case BV_BOOL:   out.push_back(((OPL_Bool*)obj)->b ? 1 : 0); break;
+            case BV_NULL:   break;
+            case BV_RAW_POINT: write_func(out, ((OPL_Point*)obj)->pointer); break;
+            case BV_ARRAY: {
+                const auto& elements = ((OPL_Array*)obj)->elements;
+                write_varint(out, elements.size());
+                for (auto e : elements)
+                    write_varint(out, object_id(e));
+                break;
+            }
+            case BV_OBJ: {
+                OPL_Object* o = (OPL_Object*)obj;
+                if (!shape_ref.count(o->shape)) {
+                    printf("SnapshotError: object without a class\n");
+                    exit(-1);
+                }
+                write_ref(out, shape_ref[o->shape]);
+                write_varint(out, o->size);
+                for (uint32_t k = 0; k < o->size; ++k) {
+                    MemberSlot& slot = o->slots()[k];
+                    out.push_back((char)slot.tag);
+                    switch (slot.tag) {
+                        case MemberSlot::SLOT_INT:   write_varint(out, zigzag(slot.i)); break;
+                        case MemberSlot::SLOT_FLOAT: write_bytes(out, &slot.f, sizeof(double)); break;
+                        case MemberSlot::SLOT_BOOL:  out.push_back(slot.b ? 1 : 0); break;
+                        case MemberSlot::SLOT_REF:   write_varint(out, object_id(slot.ref)); break;
+                        default: break;
+                    }
+                }
+                break;
+            }
+        }
+    }
+
+    void write_value(CodeBuffer& out, STACK_VALUE* value) {
+        if (value->is_heap_ref) {
+            out.push_back((char)0xFF);
+            write_varint(out, object_id(value->obj));
+            return;
+        }
+        out.push_back((char)value->kind);
+        switch (value->kind) {
+            case STACK_VALUE::S_INT:    write_varint(out, zigzag(value->i_val)); break;
+            case STACK_VALUE::S_BOOL:   out.push_back(value->b_val ? 1 : 0); break;
+            case STACK_VALUE::S_DOUBLE: write_bytes(out, &value->d_val, sizeof(double)); break;
+            case STACK_VALUE::S_STR:    write_string(out, value->str_value); break;
+            case STACK_VALUE::S_NULL:   break;
+            case STACK_VALUE::S_RAW: case STACK_VALUE::S_FUC:
+                write_func(out, value->raw_ptr);
+                break;
+        }
+    }
+
+    CodeBuffer build() {
+        CodeBuffer globals, calls;
+        write_varint(globals, vm->globals.size());
+        for (auto& g : vm->globals) {
+            write_string(globals, g.first);
+            write_varint(globals, value_id(g.second));
+        }
+        write_varint(calls, vm->calls.size());
+        for (auto f : vm->calls) {
+            if (f->is_build_in || !chunk_ref.count(f->codes)) {
+                printf("SnapshotError: unknown frame '%s'\n", f->func_name.c_str());
+                exit(-1);
+            }
+            write_ref(calls, chunk_ref[f->codes]);
+            write_varint(calls, f->pc - f->codes->code());
+            write_varint(calls, f->stack.size());
+            for (auto v : f->stack)
+                write_varint(calls, value_id(v));
+            write_varint(calls, f->names.size());
+            for (auto& n : f->names) {
+                write_string(calls, n.first);
+                write_varint(calls, value_id(n.second));
+            }
+        }
+
+        // Values reach objects and objects reach only objects, so the value
+        // table is complete before the object table is walked.
+        CodeBuffer value_table, object_table;
+        for (size_t k = 0; k < values.size(); ++k)
+            write_value(value_table, values[k]);
+        for (size_t k = 0; k < objects.size(); ++k)
+            write_object(object_table, objects[k]);
+
+        CodeBuffer out;
+        write_u32(out, COPL_IMAGE_MAGIC);
+        write_u32(out, COPL_IMAGE_VERSION);
+        CodeBuffer program = build_program(vm->frames, vm->shapes, vm->program.imports);
+        write_u32(out, program.size());
+        out += program;
+        write_varint(out, vm->modules.size());
+        for (auto m : vm->modules) {
+            write_string(out, m->name);
+            write_string(out, m->path);
+        }
+        write_varint(out, objects.size());
+        out += object_table;
+        write_varint(out, values.size());
+        out += value_table;
+        out += globals;
+        out += calls;
+        return out;
+    }
+};
+
+struct ImageReader {
+    VM* vm;
+    ByteReader in;
+    std::vector<ImageUnit> units;
+    std::vector<OPL_BasicValue*> objects;
+    std::vector<STACK_VALUE*> values;
+    // Slots to point at an object once every object exists.
+    std::vector<std::pair<OPL_BasicValue**, uint32_t>> fixups;
+
+    ImageReader(VM* vm, MappedFile* file) : vm(vm), in { file->data, file->data + file->size, true } {}
+
+    std::pair<size_t, size_t> read_ref() {
+        size_t unit = in.count(), index = in.count();
+        return std::make_pair(unit, index);
+    }
+
+    Frame* read_func() {
+        auto ref = read_ref();
+        if (ref.first >= units.size() || ref.second >= units[ref.first].funcs->size())
+            in.truncated();
+        return (*units[ref.first].funcs)[ref.second];
+    }
+
+    void refer(OPL_BasicValue** slot) {
+        uint32_t id = in.count();
+        *slot = nullptr;
+        if (id)
+            fixups.emplace_back(slot, id);
+    }
+
+    OPL_BasicValue* read_object() {
+        switch (in.read<uint8_t>()) {
+            case BV_INT:    return new OPL_Integer(in.sint());
+            case BV_FLOAT:  return new OPL_Float(in.read<double>());
+            case BV_STRING: return new OPL_String(in.read_string());
+            case BV_BOOL:   return new OPL_Bool(in.read<uint8_t>() != 0);
+            case BV_NULL:   return new OPL_Null;
+            case BV_RAW_POINT: return new OPL_Point(read_func()->clone());
+            case BV_ARRAY: {
+                uint32_t n = in.count();
+                OPL_Array* arr = new OPL_Array(n);
+                auto& elements = arr->elements;
+                for (uint32_t k = 0; k < n; ++k)
+                    refer(&elements[k]);
+                return arr;
+            }
+            case BV_OBJ: {
+                auto ref = read_ref();
+                if (ref.first >= units.size() || ref.second >= units[ref.first].shapes->size())
+                    in.truncated();
+                uint32_t size = in.count();
+                OPL_Object* o = OPL_Object::create((*units[ref.first].shapes)[ref.second], size);
+                for (uint32_t k = 0; k < size; ++k) {
+                    MemberSlot& slot = o->slots()[k];
+                    slot.tag = (MemberSlot::Tag)in.read<uint8_t>();
+                    switch (slot.tag) {
+                        case MemberSlot::SLOT_INT:   slot.i = in.sint(); break;
+                        case MemberSlot::SLOT_FLOAT: slot.f = in.read<double>(); break;
+                        case MemberSlot::SLOT_BOOL:  slot.b = in.read<uint8_t>() != 0; break;
+                        case MemberSlot::SLOT_REF:   refer(&slot.ref); break;
+                        default: break;
+                    }
+                }
+                return o;
+            }
+            default:
+                in.truncated();
+                return nullptr;
+        }
+    }
+
+    STACK_VALUE* read_value() {
+        uint8_t tag = in.read<uint8_t>();
+        if (tag == 0xFF) {
+            STACK_VALUE* v = STACK_VALUE::make_heap(nullptr);
+            refer(&v->obj);
+            return v;
+        }
+        switch (tag) {
+            case STACK_VALUE::S_INT:    return STACK_VALUE::make_int(in.sint());
+            case STACK_VALUE::S_BOOL:   return STACK_VALUE::make_bool(in.read<uint8_t>() != 0);
+            case STACK_VALUE::S_DOUBLE: return STACK_VALUE::make_double(in.read<double>());
+            case STACK_VALUE::S_STR:    return STACK_VALUE::make_str(in.read_string());
+            case STACK_VALUE::S_NULL:   return STACK_VALUE::make_null();
+            case STACK_VALUE::S_RAW: case STACK_VALUE::S_FUC:
+                return STACK_VALUE::make_func(read_func()->clone());
+            default:
+                in.truncated();
+                return nullptr;
+        }
+    }
+
+    STACK_VALUE* value(uint32_t id) {
+        if (id > values.size())
+            in.truncated();
+        return id ? values[id - 1] : nullptr;
+    }
+
+    void read() {
+        in.read<uint32_t>();
+        if (in.read<uint32_t>() != COPL_IMAGE_VERSION) {
+            printf("Unsupported image version\n");
+            exit(-1);
+        }
+        uint32_t program_len = in.read<uint32_t>();
+        char* program = in.take(program_len);
+        vm->frames = load_program(program, program_len, builtins, &vm->shapes, &vm->program.imports);
+        vm->link_program();
+        units.push_back({&vm->frames, &vm->shapes});
+
+        uint32_t module_cnt = in.count();
+        for (uint32_t k = 0; k < module_cnt; ++k) {
+            Module* m = new Module;
+            m->name = in.read_string();
+            m->path = in.read_string();
+            m->funcs = load_bytecode(m->path, builtins, &m->shapes, &m->imports);
+            vm->modules.push_back(m);
+            vm->link(m);
+            units.push_back({&m->funcs, &m->shapes});
+        }
+        // Every module is listed, so this only connects the names.
+        vm->import_all(&vm->program);
+        for (uint32_t k = 0; k < module_cnt; ++k)
+            vm->import_all(vm->modules[k]);
+
+        uint32_t object_cnt = in.count();
+        objects.reserve(object_cnt);
+        for (uint32_t k = 0; k < object_cnt; ++k)
+            objects.push_back(vm->track(read_object()));
+        uint32_t value_cnt = in.count();
+        values.reserve(value_cnt);
+        for (uint32_t k = 0; k < value_cnt; ++k)
+            values.push_back(read_value());
+        for (auto& f : fixups) {
+            if (f.second > objects.size())
+                in.truncated();
+            *f.first = objects[f.second - 1];
+        }
+
+        uint32_t global_cnt = in.count();
+        for (uint32_t k = 0; k < global_cnt; ++k) {
+            std::string name = in.read_string();
+            vm->globals[name] = value(in.count());
+        }
+
+        uint32_t call_cnt = in.count();
+        Frame* caller = nullptr;
+        for (uint32_t k = 0; k < call_cnt; ++k) {
+            Frame* f = read_func()->clone();
+            f->caller = caller;
+            f->pc = f->get_start() + in.count();
+            uint32_t depth = in.count();
+            for (uint32_t j = 0; j < depth; ++j)
+                f->stack.push_back(value(in.count()));
+            uint32_t name_cnt = in.count();
+            for (uint32_t j = 0; j < name_cnt; ++j) {
+                std::string name = in.read_string();
+                f->names[name] = value(in.count());
+            }
+            vm->calls.push_back(f);
+            caller = f;
+        }
+    }
+};
+
+inline void VM::save_image(const std::string& path) {
+    CodeBuffer out = ImageWriter(this).build();
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        printf("Cannot write image: %s\n", path.c_str());
+        exit(-1);
+    }
+    fwrite(out.data(), 1, out.size(), file);
+    fclose(file);
+}
+
+inline bool VM::resume_image(const std::string& path) {
+    MappedFile* file = map_file(path);
+    uint32_t magic = 0;
+    if (file->size >= sizeof(magic))
+        memcpy(&magic, file->data, sizeof(magic));
+    if (magic != COPL_IMAGE_MAGIC)
+        return false;
+    ImageReader(this, file).read();
+    return true;
+}
+
+#endif
@@ -6,37 +6,47 @@
 #include <vector>
 #include <algorithm>
 #include <string>
+#include <utility>
 #include <cstdint>
+#include <new>
+#include <initializer_list>
 #include "asm.hpp"
+#include "pool_allocator.hpp"
+#include "bytecode.hpp"
 
 enum BV_Kind { BV_INT, BV_FLOAT, BV_STRING, BV_BOOL, BV_ARRAY, BV_OBJ, BV_NULL, BV_RAW_POINT };
 
+// Heap values carry no vtable and no list pointer: the header is the kind and
+// the GC mark bit packed into one byte. Operations below dispatch on `kind`
+// to the same-named member of the concrete type, see the definitions after
+// OPL_Array.
 struct OPL_BasicValue {
-    OPL_BasicValue* next;
-    bool marked;
-    BV_Kind kind;
-    OPL_BasicValue(BV_Kind k) : next(nullptr), marked(false), kind(k) {}
+    uint8_t kind : 7;
+    uint8_t marked : 1;
+    OPL_BasicValue(BV_Kind k) : kind(k), marked(0) {}
 
-    virtual void operator_not_impl_error(std::string info, std::string symbol) {
+    static void* operator new(size_t size) { return PoolAllocator::current()->allocate(size); }
+    static void operator delete(void* p, size_t size) { PoolAllocator::release(p, size); }
+    static void* operator new(size_t, void* where) { return where; }
+
+    void operator_not_impl_error(std::string info, std::string symbol) {
         printf("Operator '%s' is not impl in object '%d', %s\n", symbol.c_str(), kind, info.c_str());
         throw std::exception();
     }
 
-    virtual void __set__(OPL_BasicValue*) { operator_not_impl_error("", "__set__"); }
-
-    virtual void __elementset__(OPL_BasicValue*, OPL_BasicValue*) {  operator_not_impl_error("", "__elementset__"); }
+    inline void __set__(OPL_BasicValue*);
 
-    virtual OPL_BasicValue* __elementget__(OPL_BasicValue*) { operator_not_impl_error("", "__elementget__"); return nullptr; }
+    inline void __elementset__(OPL_BasicValue*, OPL_BasicValue*);
 
-    virtual OPL_BasicValue* __memberget__(int) { operator_not_impl_error("", "__memeberget__"); return nullptr; }
+    inline OPL_BasicValue* __elementget__(OPL_BasicValue*);
 
-    virtual void __memberset__(int, OPL_BasicValue*) { operator_not_impl_error("", "__memberset__"); }
+    inline OPL_BasicValue* __copy__();
 
-    virtual OPL_BasicValue* __copy__() { operator_not_impl_error("", "__copy__"); return nullptr; }
+    static inline void destroy(OPL_BasicValue*);
 
-    void expect_(OPL_BasicValue* other, std::vector<BV_Kind> kind_) {
+    void expect_(OPL_BasicValue* other, std::initializer_list<BV_Kind> kind_) {
         if (std::count(kind_.begin(), kind_.end(), other->kind) <= 0) {
-            printf("RunningTimeError in OPL_BasicValue: want %d, get %d\n", kind_[0], other->kind);
+            printf("RunningTimeError in OPL_BasicValue: want %d, get %d\n", *kind_.begin(), other->kind);
             exit(-1);
         }
     }
@@ -53,6 +63,9 @@ struct STACK_VALUE {
     bool is_heap_ref;
     enum ValueType { S_INT, S_BOOL, S_DOUBLE, S_RAW, S_NULL, S_STR , S_FUC} kind;
 
+    static void* operator new(size_t size) { return PoolAllocator::current()->allocate(size); }
+    static void operator delete(void* p, size_t size) { PoolAllocator::release(p, size); }
+
     STACK_VALUE* copy() {
         if (is_heap_ref) {
             return make_heap(obj->__copy__());
@@ -105,21 +118,13 @@ struct STACK_VALUE {
         return sv;
     }
 
-    static STACK_VALUE* make_null() {
-        STACK_VALUE* sv = new STACK_VALUE;
-        sv->kind = S_NULL;
-        sv->is_heap_ref = false;
-        sv->i_val = 0;
-        return sv;
-    }
+    // null, true, false and ints in [SMALL_INT_MIN, SMALL_INT_MAX] come back
+    // as shared singletons, see SharedImmediates. Stack values are never
+    // written through, only strings are edited in place and those are always
+    // fresh.
+    static inline STACK_VALUE* make_null();
 
-    static STACK_VALUE* make_int(int32_t v) {
-        STACK_VALUE *sv = new STACK_VALUE;
-        sv->is_heap_ref = false;
-        sv->kind = S_INT;
-        sv->i_val = v;
-        return sv;
-    }
+    static inline STACK_VALUE* make_int(int32_t v);
 
     static STACK_VALUE* make_double(double v) {
         STACK_VALUE *sv = new STACK_VALUE;
@@ -129,13 +134,7 @@ struct STACK_VALUE {
         return sv;
     }
 
-    static STACK_VALUE* make_bool(bool v) {
-        STACK_VALUE *sv = new STACK_VALUE;
-        sv->is_heap_ref = false;
-        sv->b_val = v;
-        sv->kind = S_BOOL;
-        return sv;
-    }
+    static inline STACK_VALUE* make_bool(bool v);
 
     static STACK_VALUE* make_heap(OPL_BasicValue* v) {
         STACK_VALUE *sv = new STACK_VALUE;
@@ -147,48 +146,143 @@ struct STACK_VALUE {
     STACK_VALUE() : is_heap_ref(false), obj(nullptr) {}
 };
 
+#define SMALL_INT_MIN (-128)
+#define SMALL_INT_MAX 1023
+
+struct SharedImmediates {
+    STACK_VALUE null_value, true_value, false_value;
+    STACK_VALUE small_ints[SMALL_INT_MAX - SMALL_INT_MIN + 1];
+
+    SharedImmediates() {
+        null_value.kind = STACK_VALUE::S_NULL;
+        null_value.i_val = 0;
+        true_value.kind = false_value.kind = STACK_VALUE::S_BOOL;
+        true_value.b_val = true;
+        false_value.b_val = false;
+        for (int32_t i = SMALL_INT_MIN; i <= SMALL_INT_MAX; ++i) {
+            small_ints[i - SMALL_INT_MIN].kind = STACK_VALUE::S_INT;
+            small_ints[i - SMALL_INT_MIN].i_val = i;
+        }
+    }
+};
+
+inline SharedImmediates shared_immediates;
+
+STACK_VALUE* STACK_VALUE::make_null() { return &shared_immediates.null_value; }
+
+STACK_VALUE* STACK_VALUE::make_bool(bool v) {
+    return v ? &shared_immediates.true_value : &shared_immediates.false_value;
+}
+
+STACK_VALUE* STACK_VALUE::make_int(int32_t v) {
+    if (v >= SMALL_INT_MIN && v <= SMALL_INT_MAX)
+        return &shared_immediates.small_ints[v - SMALL_INT_MIN];
+    STACK_VALUE *sv = new STACK_VALUE;
+    sv->is_heap_ref = false;
+    sv->kind = S_INT;
+    sv->i_val = v;
+    return sv;
+}
+
 
 
 struct OPL_Null : public OPL_BasicValue {
     OPL_Null() : OPL_BasicValue(BV_NULL) { }
 };
 
-struct OPL_Object : public OPL_BasicValue {
-    std::vector<OPL_BasicValue*> members;
-    OPL_Object(std::vector<OPL_BasicValue*> m) : OPL_BasicValue(BV_OBJ), members(std::move(m)) {}
+struct ObjectShape {
+    std::string name;
+    std::vector<std::string> members;
+    std::vector<ObjectShape*> bases;
+
+    int get_offset(const std::string& member) {
+        for (size_t i = 0; i < members.size(); ++i)
+            if (members[i] == member)
+                return (int)i;
+        return -1;
+    }
 
-    OPL_BasicValue* __copy__() override {
-        std::vector<OPL_BasicValue*> tmp;
-        for (auto i : members)
-            if (i) tmp.push_back(i->__copy__());
-        return new OPL_Object(tmp);
+    // The first base is laid out as a prefix of this shape, so its offsets
+    // stay valid for every shape extending it.
+    bool extends(ObjectShape* base) {
+        for (ObjectShape* s = this; s; s = (s->bases.empty()) ? nullptr : s->bases[0])
+            if (s == base)
+                return true;
+        return false;
     }
+};
+
+struct MemberSlot {
+    enum Tag : uint8_t { SLOT_NULL, SLOT_INT, SLOT_FLOAT, SLOT_BOOL, SLOT_REF } tag;
+    union {
+        int32_t i;
+        double f;
+        bool b;
+        OPL_BasicValue* ref;
+    };
+};
+
+// Objects are one allocation: the header is followed by `size` inline slots.
+// Scalars live in the slot itself, everything else is a heap reference.
+struct OPL_Object : public OPL_BasicValue {
+    ObjectShape* shape;
+    uint32_t size;
 
-    OPL_Object(int size) : OPL_BasicValue(BV_OBJ) {
-        members.resize(size);
-        for (auto& m : members)
-            m = new OPL_Null();
+    static OPL_Object* create(ObjectShape* shape, int size) {
+        void* block = PoolAllocator::current()->allocate(alloc_size(size));
+        OPL_Object* obj = new (block) OPL_Object(shape, size);
+        for (int i = 0; i < size; ++i)
+            obj->slots()[i].tag = MemberSlot::SLOT_NULL;
+        return obj;
     }
 
-    OPL_BasicValue* __memberget__(int offset) override {
-        return members[offset];
+    static inline size_t alloc_size(int size) { return sizeof(OPL_Object) + size * sizeof(MemberSlot); }
+
+    inline MemberSlot* slots() { return reinterpret_cast<MemberSlot*>(this + 1); }
+
+    OPL_BasicValue* __copy__() {
+        OPL_Object* res = create(shape, size);
+        for (uint32_t i = 0; i < size; ++i) {
+            res->slots()[i] = slots()[i];
+            if (slots()[i].tag == MemberSlot::SLOT_REF)
+                res->slots()[i].ref = slots()[i].ref->__copy__();
+        }
+        return res;
     }
 
-    void __memberset__(int offset, OPL_BasicValue* value) override {
-        auto& target = members[offset];
-        if (target == nullptr) {
-            target = value;
-            return;
+    STACK_VALUE* __memberget__(int offset) {
+        MemberSlot& slot = slots()[offset];
+        switch (slot.tag) {
+            case MemberSlot::SLOT_INT:   return STACK_VALUE::make_int(slot.i);
+            case MemberSlot::SLOT_FLOAT: return STACK_VALUE::make_double(slot.f);
+            case MemberSlot::SLOT_BOOL:  return STACK_VALUE::make_bool(slot.b);
+            case MemberSlot::SLOT_REF:   return STACK_VALUE::make_heap(slot.ref);
+            default:                     return STACK_VALUE::make_null();
         }
-        switch (target->kind) {
-            case BV_INT: case BV_FLOAT: case BV_STRING: case BV_BOOL: case BV_ARRAY:
-                target->__set__(value);
-                break;
-            case BV_OBJ: case BV_NULL: case BV_RAW_POINT:
-                target = value;
-                break;
+    }
+
+    // Stores int, float, bool and null values inline. A typed slot keeps its
+    // type the way the boxed members did through __set__. Returns false when
+    // the value has to go through set_ref instead.
+    bool set_scalar(int offset, STACK_VALUE* value);
+
+    void set_ref(int offset, OPL_BasicValue* value) {
+        MemberSlot& slot = slots()[offset];
+        if (slot.tag == MemberSlot::SLOT_REF) {
+            switch (slot.ref->kind) {
+                case BV_INT: case BV_FLOAT: case BV_STRING: case BV_BOOL: case BV_ARRAY:
+                    slot.ref->__set__(value);
+                    return;
+                default:
+                    break;
+            }
         }
+        slot.tag = MemberSlot::SLOT_REF;
+        slot.ref = value;
     }
+
+private:
+    OPL_Object(ObjectShape* shape, int size) : OPL_BasicValue(BV_OBJ), shape(shape), size(size) {}
 };
 
 inline int get_int(void*);
@@ -197,11 +291,11 @@ struct OPL_Float : public OPL_BasicValue {
     double f;
     OPL_Float(double _f) : OPL_BasicValue(BV_FLOAT), f(_f) {}
 
-    OPL_BasicValue* __copy__() override {
+    OPL_BasicValue* __copy__() {
         return new OPL_Float(f);
     }
 
-    void __set__(OPL_BasicValue* other) override {
+    void __set__(OPL_BasicValue* other) {
         expect_(other, {BV_INT, BV_FLOAT});
         if (other->kind == BV_INT) f = get_int((void*)other);
         else if (other->kind == BV_FLOAT) f = ((OPL_Float*)other)->f;
@@ -212,11 +306,11 @@ struct OPL_Integer : public OPL_BasicValue {
     int i;
     OPL_Integer(int _i) : OPL_BasicValue(BV_INT), i(_i) {}
 
-    OPL_BasicValue* __copy__() override {
+    OPL_BasicValue* __copy__() {
         return new OPL_Integer(i);
     }
 
-    void __set__(OPL_BasicValue* other) override {
+    void __set__(OPL_BasicValue* other) {
         expect_(other, {BV_INT, BV_FLOAT});
         if (other->kind == BV_INT) i = ((OPL_Integer*)other)->i;
         else if (other->kind == BV_FLOAT) i = ((OPL_Float*)other)->f;
@@ -239,35 +333,83 @@ struct OPL_Bool : public OPL_BasicValue {
     bool b;
     OPL_Bool(bool _b) : OPL_BasicValue(BV_BOOL), b(_b) {}
 
-    OPL_BasicValue* __copy__() override {
+    OPL_BasicValue* __copy__() {
         return new OPL_Bool(b);
     }
 
-    void __set__(OPL_BasicValue* other) override {
+    void __set__(OPL_BasicValue* other) {
         expect_(other, {BV_BOOL});
         b = ((OPL_Bool*)other)->b;
     }
 };
 
+bool OPL_Object::set_scalar(int offset, STACK_VALUE* value) {
+    MemberSlot& slot = slots()[offset];
+    MemberSlot res;
+    if (value->is_heap_ref) {
+        switch (value->obj->kind) {
+            case BV_INT:   res.tag = MemberSlot::SLOT_INT;   res.i = ((OPL_Integer*)value->obj)->i; break;
+            case BV_FLOAT: res.tag = MemberSlot::SLOT_FLOAT; res.f = ((OPL_Float*)value->obj)->f; break;
+            case BV_BOOL:  res.tag = MemberSlot::SLOT_BOOL;  res.b = ((OPL_Bool*)value->obj)->b; break;
+            case BV_NULL:  res.tag = MemberSlot::SLOT_NULL;  break;
+            default: return false;
+        }
+    } else {
+        switch (value->kind) {
+            case STACK_VALUE::S_INT:    res.tag = MemberSlot::SLOT_INT;   res.i = value->i_val; break;
+            case STACK_VALUE::S_DOUBLE: res.tag = MemberSlot::SLOT_FLOAT; res.f = value->d_val; break;
+            case STACK_VALUE::S_BOOL:   res.tag = MemberSlot::SLOT_BOOL;  res.b = value->b_val; break;
+            case STACK_VALUE::S_NULL:   res.tag = MemberSlot::SLOT_NULL;  break;
+            default: return false;
+        }
+    }
+    switch (slot.tag) {
+        case MemberSlot::SLOT_INT:
+            if (res.tag == MemberSlot::SLOT_FLOAT) slot.i = res.f;
+            else if (res.tag == MemberSlot::SLOT_INT) slot.i = res.i;
+            else break;
+            return true;
+        case MemberSlot::SLOT_FLOAT:
+            if (res.tag == MemberSlot::SLOT_INT) slot.f = res.i;
+            else if (res.tag == MemberSlot::SLOT_FLOAT) slot.f = res.f;
+            else break;
+            return true;
+        case MemberSlot::SLOT_BOOL:
+            if (res.tag != MemberSlot::SLOT_BOOL) break;
+            slot.b = res.b;
+            return true;
+        case MemberSlot::SLOT_REF:
+            if (slot.ref->kind != BV_OBJ && slot.ref->kind != BV_NULL && slot.ref->kind != BV_RAW_POINT)
+                return false;
+            slot = res;
+            return true;
+        case MemberSlot::SLOT_NULL:
+            slot = res;
+            return true;
+    }
+    printf("RuntimeError in OPL_Object: cannot store value of kind %d in member %d\n", res.tag, offset);
+    exit(-1);
+}
+
 struct OPL_String : public OPL_BasicValue {
     std::string str;
     OPL_String(const std::string& st) : OPL_BasicValue(BV_STRING), str(st) {}
 
-    OPL_BasicValue* __copy__() override {
+    OPL_BasicValue* __copy__() {
         return new OPL_String(str);
     }
 
-    void __set__(OPL_BasicValue* other) override {
+    void __set__(OPL_BasicValue* other) {
         expect_(other, {BV_STRING});
         str = ((OPL_String*)other)->str;
     }
 
-    OPL_BasicValue* __elementget__(OPL_BasicValue* other) override {
+    OPL_BasicValue* __elementget__(OPL_BasicValue* other) {
         expect_(other, {BV_INT});
         return new OPL_String(std::string (1, str[((OPL_Integer*)other)->i]));
     }
 
-    void __elementset__(OPL_BasicValue* pos_, OPL_BasicValue* val_) override {
+    void __elementset__(OPL_BasicValue* pos_, OPL_BasicValue* val_) {
         expect_(pos_, {BV_INT});
         expect_(val_, {BV_STRING});
         str[((OPL_Integer*)pos_)->i] = ((OPL_String*)val_)->str[0];
@@ -279,28 +421,26 @@ struct OPL_Array : public OPL_BasicValue {
     OPL_Array(std::vector<OPL_BasicValue*> el)
     : OPL_BasicValue(BV_ARRAY), elements(std::move(el)) {}
 
-    OPL_BasicValue* __copy__() override {
-        std::vector<OPL_BasicValue*> tmp;
-        for (auto i : elements) {
-            if (i) tmp.push_back(i->__copy__());
-        }
-        return new OPL_Array(tmp);
+    OPL_BasicValue* __copy__() {
+        std::vector<OPL_BasicValue*> tmp(elements.size());
+        for (size_t i = 0; i < elements.size(); ++i)
+            tmp[i] = (elements[i]) ? elements[i]->__copy__() : nullptr;
+        return new OPL_Array(std::move(tmp));
     }
 
     OPL_Array(int size) : OPL_BasicValue(BV_ARRAY) { elements.resize(size); }
 
-    void __set__(OPL_BasicValue* other) override {
+    void __set__(OPL_BasicValue* other) {
         expect_(other, {BV_ARRAY});
         elements = ((OPL_Array*)other)->elements;
     }
 
-    OPL_BasicValue* __elementget__(OPL_BasicValue* other) override {
+    OPL_BasicValue* __elementget__(OPL_BasicValue* other) {
         expect_(other, {BV_INT});
         return elements[((OPL_Integer*)other)->i];
     }
 
-    void __elementset__(OPL_BasicValue* pos_, OPL_BasicValue* val_) override {
-        auto temp = ((OPL_Integer*)pos_)->i;
+    void __elementset__(OPL_BasicValue* pos_, OPL_BasicValue* val_) {
         expect_(pos_, {BV_INT});
         auto tmp = elements[((OPL_Integer*)pos_)->i];
         if (tmp == nullptr) {
@@ -318,11 +458,150 @@ struct OPL_Array : public OPL_BasicValue {
     }
 };
 
+void OPL_BasicValue::__set__(OPL_BasicValue* other) {
+    switch (kind) {
+        case BV_INT:    ((OPL_Integer*)this)->__set__(other); return;
+        case BV_FLOAT:  ((OPL_Float*)this)->__set__(other); return;
+        case BV_STRING: ((OPL_String*)this)->__set__(other); return;
+        case BV_BOOL:   ((OPL_Bool*)this)->__set__(other); return;
+        case BV_ARRAY:  ((OPL_Array*)this)->__set__(other); return;
+        default:        operator_not_impl_error("", "__set__");
+    }
+}
+
+void OPL_BasicValue::__elementset__(OPL_BasicValue* pos, OPL_BasicValue* val) {
+    switch (kind) {
+        case BV_STRING: ((OPL_String*)this)->__elementset__(pos, val); return;
+        case BV_ARRAY:  ((OPL_Array*)this)->__elementset__(pos, val); return;
+        default:        operator_not_impl_error("", "__elementset__");
+    }
+}
+
+OPL_BasicValue* OPL_BasicValue::__elementget__(OPL_BasicValue* pos) {
+    switch (kind) {
+        case BV_STRING: return ((OPL_String*)this)->__elementget__(pos);
+        case BV_ARRAY:  return ((OPL_Array*)this)->__elementget__(pos);
+        default:        operator_not_impl_error("", "__elementget__"); return nullptr;
+    }
+}
+
+OPL_BasicValue* OPL_BasicValue::__copy__() {
+    switch (kind) {
+        case BV_INT:    return ((OPL_Integer*)this)->__copy__();
+        case BV_FLOAT:  return ((OPL_Float*)this)->__copy__();
+        case BV_STRING: return ((OPL_String*)this)->__copy__();
+        case BV_BOOL:   return ((OPL_Bool*)this)->__copy__();
+        case BV_ARRAY:  return ((OPL_Array*)this)->__copy__();
+        case BV_OBJ:    return ((OPL_Object*)this)->__copy__();
+        default:        operator_not_impl_error("", "__copy__"); return nullptr;
+    }
+}
+
+void OPL_BasicValue::destroy(OPL_BasicValue* value) {
+    switch (value->kind) {
+        case BV_INT:        delete (OPL_Integer*)value; break;
+        case BV_FLOAT:      delete (OPL_Float*)value; break;
+        case BV_STRING:     delete (OPL_String*)value; break;
+        case BV_BOOL:       delete (OPL_Bool*)value; break;
+        case BV_ARRAY:      delete (OPL_Array*)value; break;
+        case BV_OBJ: {
+            OPL_Object* o = (OPL_Object*)value;
+            size_t bytes = OPL_Object::alloc_size(o->size);
+            o->~OPL_Object();
+            PoolAllocator::release(o, bytes);
+            break;
+        }
+        case BV_NULL:       delete (OPL_Null*)value; break;
+        case BV_RAW_POINT:  delete (OPL_Point*)value; break;
+    }
+}
+
+struct Frame;
+struct Module;
+
+// A module a unit imports: the path of its .copl and the name the unit
+// calls it by.
+typedef std::pair<std::string, std::string> ImportRef;   // path, name
+
+// Per-site cache used by the quickened member and method instructions.
+// The first shape seen is checked inline (monomorphic), up to IC_POLY_SIZE
+// shapes are kept after that, and a full site falls back to lookup by name.
+struct InlineCache {
+    static const int IC_POLY_SIZE = 4;
+    enum State { IC_EMPTY, IC_MONO, IC_POLY, IC_MEGA } state = IC_EMPTY;
+
+    struct Entry {
+        ObjectShape* shape;
+        int offset;
+        Frame* callee;
+    };
+
+    Entry entries[IC_POLY_SIZE];
+    int size = 0;
+    int origin = -1;
+    std::string member;
+
+    InlineCache(int origin, std::string member) : origin(origin), member(std::move(member)) {}
+
+    inline Entry* lookup(ObjectShape* shape) {
+        if (size && entries[0].shape == shape)
+            return &entries[0];
+        for (int i = 1; i < size; ++i)
+            if (entries[i].shape == shape)
+                return &entries[i];
+        return nullptr;
+    }
+
+    void insert(ObjectShape* shape, int offset, Frame* callee) {
+        if (size == IC_POLY_SIZE) {
+            state = IC_MEGA;
+            return;
+        }
+        entries[size++] = {shape, offset, callee};
+        state = (size == 1) ? IC_MONO : IC_POLY;
+    }
+};
+
 struct Chunk {
+    // One int per opcode and operand, as the compiler and v1 files produce
+    // it. encode() turns it into the byte stream the VM runs.
     std::vector<int> op_codes;
+    std::vector<uint8_t> bytes;
+    // Code used in place from a mapped .copl file, bytes stays empty then.
+    uint8_t* mapped_code = nullptr;
+    size_t mapped_size = 0;
+
+    inline uint8_t* code() { return mapped_code ? mapped_code : bytes.data(); }
+
+    inline size_t code_size() const { return mapped_code ? mapped_size : bytes.size(); }
+
+    inline void encode();
+
+    // Set while the body still sits undecoded in a mapped file, see
+    // program_loader.hpp. Everything but the code pointer is empty until
+    // the first call.
+    void (*lazy_loader)(Chunk*) = nullptr;
+    char* lazy_body = nullptr;
+    size_t lazy_size = 0;
+
+    inline void ensure_loaded() {
+        if (lazy_loader)
+            lazy_loader(this);
+    }
+
+    // The program or module this code was loaded from. Function and class
+    // ids in the code are relative to its place in the VM's linked tables.
+    Module* module = nullptr;
+
     std::vector<STACK_VALUE*> const_pool;
     std::vector<OPL_BasicValue> cons;
     std::vector<std::string> names;
+    std::vector<InlineCache> inline_caches;
+
+    int add_inline_cache(int origin, std::string member = "") {
+        inline_caches.emplace_back(origin, member);
+        return inline_caches.size() - 1;
+    }
 
     int get_name(std::string name) {
         for (int i = 0; i < names.size(); ++i)
@@ -384,7 +663,8 @@ struct Frame {
 
     BUILD_IN_PROC* proc;
 
-    int* pc, func_id, args_len = 0;
+    uint8_t* pc;
+    int func_id, args_len = 0;
     Chunk *codes;
     std::string func_name;
     Frame* caller;
@@ -399,12 +679,15 @@ struct Frame {
 
     inline std::string get_name_by_id(int id) { return codes->names[id]; }
 
-    inline int* get_start() {
-        if (codes->op_codes.empty() || is_build_in) {
+    // Only for entering the function; jumps index codes->code() directly.
+    inline uint8_t* get_start() {
+        if (!is_build_in)
+            codes->ensure_loaded();
+        if (is_build_in || codes->code_size() == 0) {
             std::cout << "In SubProc <Frame.get_start>, want get start, but " << ((is_build_in)? "the function is a build-in function" : "code is empty") << std::endl;
             exit(-1);
         }
-        return &codes->op_codes[0];
+        return codes->code();
     }
 
     inline STACK_VALUE* top() { return stack[stack.size() - 1]; }
@@ -435,22 +718,22 @@ struct Frame {
     Frame(Chunk codes) {
         caller = nullptr;
         this->tmp = codes;
-        this->codes->op_codes = this->tmp.op_codes;
-        pc = &this->tmp.op_codes[0];
+        this->codes = &this->tmp;
+        pc = this->tmp.code();
     }
 
     bool is_lambda = false;
 
-    Frame(Chunk *codes) { caller = nullptr; this->codes = codes; pc = &this->codes->op_codes[0]; }
+    Frame(Chunk *codes) { caller = nullptr; this->codes = codes; pc = codes->code(); }
 
-    Frame(Frame* caller) { caller = nullptr;this->caller = caller; pc = &codes->op_codes[0]; }
+    Frame(Frame* caller) { caller = nullptr;this->caller = caller; pc = codes->code(); }
 
     void debug() {
-        printf("Function['%s', %zu]\n", func_name.c_str(), codes->op_codes.size());
+        printf("Function['%s', %zu]\n", func_name.c_str(), codes->code_size());
         int i = 0;
-        while (i < codes->op_codes.size()) {
+        while (i < codes->code_size()) {
             if (!(i % 16)) printf("\n\t");
-            printf("%d ", codes->op_codes[i]);
+            printf("%02x ", codes->code()[i]);
             ++i;
         }
         printf("\n");
@@ -469,7 +752,7 @@ static const struct {
      {"OP_SET_NAME", 1},
      {"OP_LOAD_IMMEDIATLY", 1},
      {"OP_COPY", 0},
-     {"OP_LOAD_FUNC_ADDR", 0},
+     {"OP_LOAD_FUNC_ADDR", 1},
      {"OP_LOAD_MODULE_METHOD", 1},
      {"OP_LOAD_MODULE", 2},
      {"OP_POP", 0},
@@ -513,18 +796,112 @@ static const struct {
      {"OP_PRINT", 0},
      {"OP_HALT", 0},
      {"OP_NOP", 0},
+     {"OP_ROT", 0},
      {"OP_SWAP", 0},
-     {"OP_ROT", 0}
+     {"OP_NEW_INSTANCE", 1},
+     {"OP_INVOKE", 2},
+     {"OP_MEMBER_GET_IC", 1},
+     {"OP_MEMBER_SET_IC", 1},
+     {"OP_INVOKE_IC", 2},
+     {"OP_LOAD_MODULE_METHOD_IC", 1},
+     {"OP_CALL_MODULE_IC", 1}
 };
 
 static const int instruction_count = sizeof(instruction_info) / sizeof(instruction_info[0]);
 
+inline bool is_jump(int op) { return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE; }
+
+inline bool is_quickened_site(int op) {
+    return op == OP_MEMBER_GET || op == OP_MEMBER_SET || op == OP_INVOKE || op == OP_LOAD_MODULE_METHOD;
+}
+
+inline uint32_t encode_operand(int op, int value) {
+    return (op == OP_LOAD_IMMEDIATLY) ? zigzag(value) : (uint32_t)value;
+}
+
+inline int read_operand(int op, uint8_t*& p) {
+    uint32_t v = read_varint(p);
+    return (op == OP_LOAD_IMMEDIATLY) ? unzigzag(v) : (int)v;
+}
+
+// Jump operands are absolute byte offsets, so their width depends on the
+// layout; widths only grow, so relaxing until nothing changes terminates.
+// The first operand of a site that quickens is wide enough to later hold
+// any inline cache index of this chunk.
+void Chunk::encode() {
+    struct Insn { int at, op, argc; int width[2]; };
+    std::vector<Insn> insns;
+    std::unordered_map<int, int> insn_at;
+    int sites = 0;
+    for (int i = 0; i < (int)op_codes.size();) {
+        int op = op_codes[i];
+        if (op < 0 || op >= instruction_count) {
+            printf("Invalid opcode %d at %d\n", op, i);
+            exit(-1);
+        }
+        int argc = instruction_info[op].arg_count;
+        insn_at[i] = insns.size();
+        insns.push_back({i, op, argc, {0, 0}});
+        sites += is_quickened_site(op);
+        i += 1 + argc;
+    }
+    insn_at[op_codes.size()] = insns.size();
+
+    for (auto& in : insns) {
+        for (int k = 0; k < in.argc; ++k)
+            in.width[k] = is_jump(in.op) ? 1 : varint_width(encode_operand(in.op, op_codes[in.at + 1 + k]));
+        if (is_quickened_site(in.op) && sites > 1 && in.width[0] < varint_width(sites - 1))
+            in.width[0] = varint_width(sites - 1);
+    }
+
+    std::vector<uint32_t> offset(insns.size() + 1);
+    for (bool changed = true; changed;) {
+        uint32_t at = 0;
+        for (size_t j = 0; j < insns.size(); ++j) {
+            offset[j] = at;
+            at += 1 + insns[j].width[0] + insns[j].width[1];
+        }
+        offset[insns.size()] = at;
+        changed = false;
+        for (auto& in : insns) {
+            if (!is_jump(in.op))
+                continue;
+            auto target = insn_at.find(op_codes[in.at + 1]);
+            if (target == insn_at.end()) {
+                printf("Jump into the middle of an instruction at %d\n", in.at);
+                exit(-1);
+            }
+            int w = varint_width(offset[target->second]);
+            if (w > in.width[0]) {
+                in.width[0] = w;
+                changed = true;
+            }
+        }
+    }
+
+    bytes.clear();
+    bytes.reserve(offset[insns.size()]);
+    for (auto& in : insns) {
+        bytes.push_back((uint8_t)in.op);
+        for (int k = 0; k < in.argc; ++k) {
+            int v = op_codes[in.at + 1 + k];
+            uint32_t operand = is_jump(in.op) ? offset[insn_at[v]] : encode_operand(in.op, v);
+            append_varint(bytes, operand, in.width[k]);
+        }
+    }
+    mapped_code = nullptr;
+    mapped_size = 0;
+    op_codes.clear();
+    op_codes.shrink_to_fit();
+}
+
 void disassemble_instruction(Chunk* chunk, int* offset) {
-    int op = chunk->op_codes[*offset];
+    uint8_t* p = chunk->code() + *offset;
+    int op = *p++;
     const auto& info = instruction_info[op];
     printf("%s", info.name);
     if (info.arg_count == 1) {
-        int arg = chunk->op_codes[*offset + 1];
+        int arg = read_operand(op, p);
         printf("\t\t%d", arg);
 
         if (op == OP_LOAD_CONST) {
@@ -556,18 +933,32 @@ void disassemble_instruction(Chunk* chunk, int* offset) {
         else if (op == OP_MEMBER_GET || op == OP_MEMBER_SET) {
             printf(" offset=%d", arg);
         }
+        else if (op == OP_MEMBER_GET_IC || op == OP_MEMBER_SET_IC
+                 || op == OP_LOAD_MODULE_METHOD_IC || op == OP_CALL_MODULE_IC) {
+            printf(" cache=%d", arg);
+        }
+        printf("\n");
+    } else if (info.arg_count == 2) {
+        int arg0 = read_operand(op, p);
+        int arg1 = read_operand(op, p);
+        printf("\t\t%d %d", arg0, arg1);
+        if (op == OP_INVOKE) {
+            STACK_VALUE* val = chunk->const_pool[arg0];
+            if (val->kind == STACK_VALUE::S_STR)
+                printf(" (%s, argc=%d)", val->str_value.c_str(), arg1);
+        }
         printf("\n");
-        *offset += 2;
     } else {
         printf("\n");
-        *offset += 1;
     }
+    *offset = p - chunk->code();
 }
 
 void disassemble_chunk(Chunk* chunk, const char* name) {
+    chunk->ensure_loaded();
     printf("== %s ==\n", name);
     int offset = 0;
-    while (offset < chunk->op_codes.size()) {
+    while (offset < chunk->code_size()) {
         printf("%04d  ", offset);
         disassemble_instruction(chunk, &offset);
     }
@@ -1,6 +1,7 @@
 #ifndef COPL_VM_HPP
 #define COPL_VM_HPP
 #include "program_loader.hpp"
+#include "module_loader.hpp"
 #include "value.hpp"
 #include <cmath>
 #include "native_proc.hpp"
@@ -9,7 +10,17 @@
 
 struct Module {
     std::vector<Frame*> funcs;
-    std::string name;
+    std::vector<ObjectShape*> shapes;
+    std::string name, path;
+    // Offsets of this module's ids in VM::functions and VM::classes.
+    int func_base = 0, shape_base = 0;
+    // False until the first call into a module imported lazily.
+    bool loaded = true;
+    // The unit's import table and the module each of its names stands for.
+    // Names are per unit: two modules may import different files under the
+    // same name.
+    std::vector<ImportRef> imports;
+    std::unordered_map<std::string, Module*> imported;
 
     bool is_exist(std::string fname) {
         for (auto i : funcs)
@@ -30,31 +41,29 @@ struct Module {
 class VM {
 public:
 
+    // Takes either a .copl file or an image written by snapshot().
     VM(std::string path, bool is_debug = false) : is_debug(is_debug) {
-        this->frames = load_bytecode(path, builtins);
-        heap_head = new OPL_BasicValue(BV_NULL);
-        calls.push_back(find_function_by_name("main"));
+        if (!resume_image(path)) {
+            this->frames = load_bytecode(path, builtins, &shapes, &program.imports);
+            program.path = path;
+            link_program();
+            start_main();
+        }
         execute();
     }
 	
-	VM(Frame* f, VM* vm, bool is_debug) {
-		this->is_debug = is_debug;
-		std::string name = vm->current_module;
-		for (auto l : vm->modules) {
-			if (l->name == name)
-				this->frames = l->funcs;
-		}
-		for (auto l : vm->modules)
-			if (l->name != name)
-				modules.push_back(l);
-		calls.push_back(f);
-		execute();
-	}
-
     VM(std::vector<Frame*> frames, bool is_debug = false) : is_debug(is_debug) {
         this->frames = frames;
-        heap_head = new OPL_BasicValue(BV_NULL);
-        calls.push_back(find_function_by_name("main"));
+        link_program();
+        start_main();
+        execute();
+    }
+
+    VM(std::vector<Frame*> frames, std::vector<ObjectShape*> shapes, bool is_debug = false) : is_debug(is_debug) {
+        this->frames = frames;
+        this->shapes = shapes;
+        link_program();
+        start_main();
         execute();
     }
 
@@ -68,17 +77,25 @@ public:
 
     bool execute() {
         while (!calls.empty()) {
-#define GET *(get_current()->pc++)
+#define GET ((int)read_varint(get_current()->pc))
             if (get_current()->is_build_in) {
-                get_current()->__build_in_call__();
+                Frame* call = get_current();
+                std::string image = (call->proc == &snapshot) ? get_string(call->stack[0]) : "";
+                call->__build_in_call__();
                 calls.pop_back();
+                // Written once the marker has returned, so resuming continues after the call.
+                if (call->proc == &snapshot)
+                    save_image(image);
                 debug();
                 continue;
             }
-            i = GET;
+            i = *(get_current()->pc++);
             switch (i) {
                 case OP_LOAD_CONST: {
                     auto tmp = get_current()->load_const(GET);
+                    // append/pop_back edit stack strings in place, keep the pool intact
+                    if (tmp->kind == STACK_VALUE::S_STR && !tmp->is_heap_ref)
+                        tmp = STACK_VALUE::make_str(tmp->str_value);
                     get_current()->push(tmp);
                     debug();
                     break;
@@ -679,7 +696,7 @@ public:
 
                 case OP_JUMP: {
                     auto addr = GET;
-                    get_current()->pc = get_current()->get_start() + addr;
+                    get_current()->pc = get_current()->codes->code() + addr;
                     debug();
                     break;
                 }
@@ -703,7 +720,7 @@ public:
                         b = cond->b_val;
                     }
                     if (!b)
-                        get_current()->pc = get_current()->get_start() + addr;
+                        get_current()->pc = get_current()->codes->code() + addr;
                     debug();
                     break;
                 }
@@ -727,7 +744,7 @@ public:
                         b = cond->b_val;
                     }
                     if (b)
-                        get_current()->pc = get_current()->get_start() + addr;
+                        get_current()->pc = get_current()->codes->code() + addr;
                     debug();
                     break;
                 }
@@ -753,7 +770,7 @@ public:
                 }
 
                 case OP_CALL: {
-                    create_task_by_id(GET);
+                    create_task(linked_function(GET));
                     debug();
                     break;
                 }
@@ -794,9 +811,7 @@ public:
                 case OP_COPY: {
                     auto val = get_current()->pop();
                     if (val->is_heap_ref) {
-                        OPL_BasicValue* copy = val->obj->__copy__();
-                        get_tail()->next = copy;
-                        copy->next = nullptr;
+                        OPL_BasicValue* copy = track(val->obj->__copy__());
                         get_current()->push(STACK_VALUE::make_heap(copy));
                     } else {
                         get_current()->push(val);
@@ -806,7 +821,7 @@ public:
                 }
 
                 case OP_LOAD_IMMEDIATLY: {
-                    get_current()->push(STACK_VALUE::make_int(GET));
+                    get_current()->push(STACK_VALUE::make_int(unzigzag(read_varint(get_current()->pc))));
                     debug();
                     break;
                 }
@@ -832,29 +847,61 @@ public:
                 }
 
                 // OP_LOAD_MODULE_METHOD <mod_name>(on stack top) <method_name>
+                // The function is looked up by name once, then the site
+                // quickens: into OP_CALL_MODULE_IC when the OP_SPECIAL_CALL
+                // of a call follows, OP_LOAD_MODULE_METHOD_IC otherwise.
                 case OP_LOAD_MODULE_METHOD: {
-					is_p_modile = true;
+                    uint8_t* site = get_current()->pc - 1;
+                    int method_at = GET;
                     std::string mod_name = ((OPL_String*)val_conv(get_current()->pop()))->str;
-					current_module = mod_name;
-                    std::string method_name = ((OPL_String*)val_conv(get_current()->load_const(GET)))->str;
-                    get_current()->push(STACK_VALUE::make_func((void*) (find_method_proc(mod_name, method_name))->clone()));
+                    std::string method_name = ((OPL_String*)val_conv(get_current()->load_const(method_at)))->str;
+                    Chunk* codes = get_current()->codes;
+                    Frame* proc = find_method_proc(codes->module, mod_name, method_name);
+                    // Files written before these sites were padded may have
+                    // no room for the cache index; they stay generic.
+                    uint8_t* operand = site + 1;
+                    read_varint(operand);
+                    if (varint_width(codes->inline_caches.size()) <= operand - site - 1) {
+                        int cache = codes->add_inline_cache(method_at, method_name);
+                        codes->inline_caches[cache].insert(nullptr, 0, proc);
+                        site[0] = (*get_current()->pc == OP_SPECIAL_CALL) ? OP_CALL_MODULE_IC : OP_LOAD_MODULE_METHOD_IC;
+                        patch_varint(site + 1, cache);
+                    }
+                    get_current()->push(STACK_VALUE::make_func((void*)proc->clone()));
                     break;
                 }
 
-                // OP_LOAD_MODULE <path> <name>
+                case OP_LOAD_MODULE_METHOD_IC: {
+                    Frame* proc = get_current()->codes->inline_caches[GET].entries[0].callee;
+                    get_current()->pop();
+                    get_current()->push(STACK_VALUE::make_func((void*)proc->clone()));
+                    debug();
+                    break;
+                }
+
+                // OP_CALL_MODULE_IC <cache>, makes the call of the
+                // OP_SPECIAL_CALL after it, which is skipped.
+                case OP_CALL_MODULE_IC: {
+                    Frame* proc = get_current()->codes->inline_caches[GET].entries[0].callee;
+                    get_current()->pop();
+                    get_current()->pc++;
+                    create_task(proc);
+                    debug();
+                    break;
+                }
+
+                // OP_LOAD_MODULE <path> <name>, already done at link time
+                // for files with an import table.
                 case OP_LOAD_MODULE: {
                     std::string path = ((OPL_String*)val_conv(get_current()->load_const(GET)))->str;
                     std::string name = ((OPL_String*)val_conv(get_current()->load_const(GET)))->str;
-                    Module* m = new Module;
-                    m->name = name;
-                    m->funcs = load_bytecode(path, builtins);
-                    modules.push_back(m);
+                    import_module(get_current()->codes->module, path, name);
                     break;
                 }
 
                 case OP_LOAD_FUNC_ADDR: {
                     auto id = GET;
-                    auto lf = find_function_by_id(id)->clone();
+                    auto lf = linked_function(id)->clone();
                     get_current()->push(STACK_VALUE::make_func((void*)lf));
                     break;
                 }
@@ -871,12 +918,7 @@ public:
 		            }
 		            for (int g = 0; g < callee->args_len; ++g)
 			            callee->push(caller->pop());
-					if (!is_p_modile) calls.push_back(callee);
-					else {
-						VM sub_proc(callee, this, is_debug);
-						is_p_modile = false;
-						current_module = "";
-					}
+		            calls.push_back(callee);
 		            break;
 	            }
 
@@ -915,30 +957,67 @@ public:
                     break;
                 }
 
-                case OP_MEMBER_GET: {
+                case OP_NEW_INSTANCE: {
+                    get_current()->push(new_instance(linked_class(GET)));
+                    debug();
+                    break;
+                }
+
+                // The generic forms rewrite themselves into the cached forms
+                // on first execution and re-dispatch.
+                case OP_MEMBER_GET: case OP_MEMBER_SET: {
+                    uint8_t* site = get_current()->pc - 1;
+                    int origin = GET;
+                    site[0] = (i == OP_MEMBER_GET) ? OP_MEMBER_GET_IC : OP_MEMBER_SET_IC;
+                    patch_varint(site + 1, get_current()->codes->add_inline_cache(origin));
+                    get_current()->pc = site;
+                    break;
+                }
+
+                case OP_INVOKE: {
+                    uint8_t* site = get_current()->pc - 1;
+                    std::string method = get_current()->load_const(GET)->str_value;
+                    int argc = GET;
+                    site[0] = OP_INVOKE_IC;
+                    patch_varint(site + 1, get_current()->codes->add_inline_cache(argc, method));
+                    get_current()->pc = site;
+                    break;
+                }
+
+                case OP_MEMBER_GET_IC: {
                     auto obj = get_current()->pop();
-                    if (!obj) {
-                        std::cout << "in OP_MEMBER_GET, obj is null pointer\n";
-                        exit(-1);
-                    }
-                    if (!obj->is_heap_ref || !obj->obj) {
-                        std::cout << "object is not a heap ref or value is null\n";
-                        exit(-1);
-                    }
-                    expect_heap_val(obj, BV_OBJ);
-                    int index = GET;
-                    auto member = ((OPL_Object*)obj->obj)->__memberget__(index);
-                    get_current()->push(STACK_VALUE::make_heap(member));
+                    expect_object(obj);
+                    auto object = (OPL_Object*)obj->obj;
+                    int offset = resolve_member(get_current()->codes->inline_caches[GET], object);
+                    get_current()->push(object->__memberget__(offset));
                     debug();
                     break;
                 }
 
-                case OP_MEMBER_SET: {
+                case OP_MEMBER_SET_IC: {
                     auto val = get_current()->pop();
                     auto obj = get_current()->pop();
-                    expect_heap_val(obj, BV_OBJ);
-                    int index = GET;
-                    ((OPL_Object*)obj->obj)->__memberset__(index, val_conv(val));
+                    expect_object(obj);
+                    auto object = (OPL_Object*)obj->obj;
+                    int offset = resolve_member(get_current()->codes->inline_caches[GET], object);
+                    if (!object->set_scalar(offset, val))
+                        object->set_ref(offset, val_conv(val));
+                    debug();
+                    break;
+                }
+
+                // OP_INVOKE_IC <cache> <argc>, the receiver sits below the arguments
+                case OP_INVOKE_IC: {
+                    InlineCache& ic = get_current()->codes->inline_caches[GET];
+                    int argc = GET;
+                    auto& stack = get_current()->stack;
+                    if (stack.size() < (size_t)argc + 1) {
+                        printf("RuntimeError in pop: pop from empty stack\n");
+                        exit(-1);
+                    }
+                    auto obj = stack[stack.size() - 1 - argc];
+                    expect_object(obj);
+                    create_task(resolve_method(ic, (OPL_Object*)obj->obj));
                     debug();
                     break;
                 }
@@ -953,23 +1032,49 @@ public:
                 }
             }
         }
+        if (is_debug)
+            pool.dump_stats();
         return true;
     }
 
+    const PoolAllocator& get_pool() const { return pool; }
+
+    void save_image(const std::string& path);
+
+    bool resume_image(const std::string& path);
+
 private:
+    // Every value allocated while this VM runs comes from here.
+    PoolAllocator pool;
     std::vector<Frame*> frames;
     std::vector<Frame*> calls;
     std::vector<Module*> modules;
-    OPL_BasicValue* heap_head;
+    std::vector<ObjectShape*> shapes;
+    std::vector<OPL_BasicValue*> heap;
     std::unordered_map<std::string, STACK_VALUE*> globals;
+    // The program and every loaded module, linked into one id space: the
+    // code of a unit refers to function id k as functions[func_base + k].
+    Module program;
+    std::vector<Frame*> functions;
+    std::vector<ObjectShape*> classes;
+    std::unordered_map<ObjectShape*, Module*> class_units;
+    // Set COPL_LAZY_IMPORTS=1 to load a module on its first call instead
+    // of prefetching the whole import graph when main starts.
+    bool lazy_imports = lazy_imports_requested();
+    ModuleLoader loader;
     friend struct Frame;
-
-    Frame* find_method_proc(std::string mod_name, std::string method_name) {
-        for (auto _i : modules)
-            if (_i->name == mod_name && _i->is_exist(method_name))
-                return _i->load_func(method_name);
-        std::cout << "module '" << mod_name << "' not found\n";
-        exit(-1);
+    friend struct ImageWriter;
+    friend struct ImageReader;
+
+    // `mod_name` is a name the calling unit `from` imports.
+    Frame* find_method_proc(Module* from, const std::string& mod_name, const std::string& method_name) {
+        auto it = from->imported.find(mod_name);
+        if (it == from->imported.end()) {
+            std::cout << "module '" << mod_name << "' not found\n";
+            exit(-1);
+        }
+        ensure_linked(it->second);
+        return it->second->load_func(method_name);
     }
 
     OPL_BasicValue* val_conv(STACK_VALUE* value) {
@@ -1000,18 +1105,13 @@ private:
         default:
             return nullptr;
         }
-        get_tail()->next = new_obj;
-        new_obj->next = nullptr;
-        return new_obj;
+        return track(new_obj);
     }
 	
-	std::string current_module;
-	bool is_p_modile = false;
-	
 	Frame* get_current() { if (calls.empty()) { return nullptr; } return calls.back(); }
 
-    void create_task_by_id(int id) {
-        Frame* callee = find_function_by_id(id)->clone();
+    void create_task(Frame* func) {
+        Frame* callee = func->clone();
         Frame* caller = get_current();
         callee->caller = caller;
         if (!callee->is_build_in) callee->pc = callee->get_start();
@@ -1020,14 +1120,159 @@ private:
         calls.push_back(callee);
     }
 
-    void create_task_by_name(std::string id) {
-        Frame* callee = find_function_by_name(id)->clone();
-        Frame* caller = get_current();
-        callee->caller = caller;
-        if (!callee->is_build_in) callee->pc = callee->get_start();
-        for (int w = 0; w < callee->args_len; ++w)
-            callee->push(caller->pop());
-        calls.push_back(callee);
+    void link(Module* m) {
+        m->func_base = functions.size();
+        int max_id = -1;
+        for (auto f : m->funcs)
+            max_id = std::max(max_id, f->func_id);
+        functions.resize(m->func_base + max_id + 1, nullptr);
+        for (auto f : m->funcs) {
+            if (f->func_id >= 0)
+                functions[m->func_base + f->func_id] = f;
+            if (!f->is_build_in)
+                f->codes->module = m;
+        }
+        m->shape_base = classes.size();
+        for (auto s : m->shapes) {
+            classes.push_back(s);
+            class_units[s] = m;
+        }
+    }
+
+    void link_program() {
+        program.funcs = frames;
+        program.shapes = shapes;
+        link(&program);
+    }
+
+    inline Frame* linked_function(int id) {
+        size_t at = get_current()->codes->module->func_base + id;
+        if (at >= functions.size() || !functions[at]) {
+            printf("Function '%d' not found\n", id);
+            exit(-1);
+        }
+        return functions[at];
+    }
+
+    inline ObjectShape* linked_class(int id) {
+        return classes[get_current()->codes->module->shape_base + id];
+    }
+
+    static bool lazy_imports_requested() {
+        const char* env = getenv("COPL_LAZY_IMPORTS");
+        return env && *env && *env != '0';
+    }
+
+    // Makes `name` in unit `from` stand for the module at `path`. A file is
+    // loaded once, whichever units import it and by whatever name.
+    Module* import_module(Module* from, const std::string& path, const std::string& name) {
+        auto it = from->imported.find(name);
+        if (it != from->imported.end())
+            return it->second;
+        Module* m = (path == program.path) ? &program : nullptr;
+        for (auto k : modules)
+            if (k->path == path)
+                m = k;
+        if (!m) {
+            m = new Module;
+            m->name = name;
+            m->path = path;
+            m->loaded = false;
+            modules.push_back(m);
+        }
+        from->imported[name] = m;
+        if (!lazy_imports)
+            ensure_linked(m);
+        return m;
+    }
+
+    void import_all(Module* from) {
+        for (auto& i : from->imports)
+            import_module(from, i.first, i.second);
+    }
+
+    // A module's main never runs: its imports come from its import table.
+    void ensure_linked(Module* m) {
+        if (m->loaded)
+            return;
+        ModuleLoader::Loaded res = loader.take(m->path);
+        m->funcs = std::move(res.funcs);
+        m->shapes = std::move(res.shapes);
+        m->imports = std::move(res.imports);
+        m->loaded = true;
+        link(m);
+        import_all(m);
+    }
+
+    void start_main() {
+        Frame* main = find_function_by_name("main");
+        if (!lazy_imports)
+            for (auto& i : program.imports)
+                loader.prefetch(i.first);
+        import_all(&program);
+        main->pc = main->get_start();
+        calls.push_back(main);
+    }
+
+    void create_task_by_id(int id) { create_task(linked_function(id)); }
+
+    void create_task_by_name(std::string id) { create_task(find_function_by_name(id)); }
+
+    void expect_object(STACK_VALUE* value) {
+        if (!value || !value->is_heap_ref || !value->obj) {
+            std::cout << "object is not a heap ref or value is null\n";
+            exit(-1);
+        }
+        expect_heap_val(value, BV_OBJ);
+    }
+
+    // The offset recorded by the compiler is right for the first receiver, later
+    // shapes are resolved through the member name it maps to.
+    int resolve_member(InlineCache& ic, OPL_Object* object) {
+        if (auto hit = ic.lookup(object->shape))
+            return hit->offset;
+        int offset = ic.origin;
+        if (object->shape) {
+            int k = 0;
+            while (k < ic.size && !(ic.entries[k].shape && object->shape->extends(ic.entries[k].shape)))
+                ++k;
+            if (k < ic.size)
+                offset = ic.entries[k].offset;
+            else if (ic.member.empty() && offset >= 0 && (size_t)offset < object->shape->members.size())
+                ic.member = object->shape->members[offset];
+            else if (!ic.member.empty())
+                offset = object->shape->get_offset(ic.member);
+        }
+        if (offset < 0 || (uint32_t)offset >= object->size) {
+            printf("RuntimeError: object has no member '%s'\n", ic.member.c_str());
+            exit(-1);
+        }
+        ic.insert(object->shape, offset, nullptr);
+        return offset;
+    }
+
+    Frame* find_method(ObjectShape* shape, const std::string& method) {
+        std::string name = shape->name + "$" + method;
+        auto unit = class_units.find(shape);
+        for (auto ti : (unit != class_units.end()) ? unit->second->funcs : frames)
+            if (ti->func_name == name)
+                return ti;
+        for (auto base : shape->bases)
+            if (auto res = find_method(base, method))
+                return res;
+        return nullptr;
+    }
+
+    Frame* resolve_method(InlineCache& ic, OPL_Object* object) {
+        if (auto hit = ic.lookup(object->shape))
+            return hit->callee;
+        Frame* callee = (object->shape) ? find_method(object->shape, ic.member) : nullptr;
+        if (!callee) {
+            printf("RuntimeError: method '%s' not found\n", ic.member.c_str());
+            exit(-1);
+        }
+        ic.insert(object->shape, -1, callee);
+        return callee;
     }
 
     void expect_val(STACK_VALUE* value, STACK_VALUE::ValueType valueType) {
@@ -1056,20 +1301,19 @@ private:
         return ((OPL_String*)value->obj)->str;
     }
 
-    OPL_BasicValue* get_tail() {
-        OPL_BasicValue* head_ = heap_head;
-        while (head_->next) head_ = head_->next;
-        return head_;
+    template <typename T>
+    T* track(T* value) {
+        heap.push_back(value);
+        return value;
     }
 
     void element_set(STACK_VALUE* object, STACK_VALUE* pos, STACK_VALUE* value) {
         if (object->is_heap_ref) {
             auto arr_obj = object->obj;
             int position = ((OPL_Integer*)val_conv(pos))->i;
-            auto op = new OPL_Integer(position);
+            OPL_Integer op(position);
             auto val_obj = val_conv(value);
-            arr_obj->__elementset__(op, val_obj);
-            delete op;
+            arr_obj->__elementset__(&op, val_obj);
         } else if (object->kind == STACK_VALUE::S_STR) {
             object->str_value[pos->i_val] = ((OPL_String*)val_conv(value))->str[0];
         }
@@ -1087,32 +1331,35 @@ private:
             return v;
         }
         auto obj = object->obj;
-        auto pos_obj = (pos->is_heap_ref)? pos->obj : new OPL_Integer(pos->i_val);
+        OPL_Integer tmp_pos(pos->i_val);
+        auto pos_obj = (pos->is_heap_ref)? pos->obj : &tmp_pos;
         auto result = obj->__elementget__(pos_obj);
-        delete pos_obj;
         return STACK_VALUE::make_heap(result);
     }
 
     STACK_VALUE* new_array(int size) {
         OPL_Array* new_array = new OPL_Array(size);
-        get_tail()->next = new_array;
-        new_array->next = nullptr;
+        track(new_array);
         STACK_VALUE* value = new STACK_VALUE;
         value->is_heap_ref = true;
         value->obj = new_array;
         return value;
     }
 
-    STACK_VALUE* new_object(int size) {
-        OPL_Object* obj = new OPL_Object(size);
-        get_tail()->next = obj;
-        obj->next = nullptr;
+    STACK_VALUE* new_object(int size, ObjectShape* shape = nullptr) {
+        OPL_Object* obj = OPL_Object::create(shape, size);
+        track(obj);
         STACK_VALUE* value = new STACK_VALUE;
         value->is_heap_ref = true;
         value->obj = obj;
         return value;
     }
 
+    STACK_VALUE* new_instance(ObjectShape* shape) {
+        return new_object(shape->members.size(), shape);
+    }
+
+
     Frame* find_function_by_name(std::string name) {
         for (auto ti : frames)
             if (ti->func_name == name)
@@ -1131,4 +1378,6 @@ private:
 
 };
 
+#include "snapshot.hpp"
+
 #endif
\ No newline at end of file
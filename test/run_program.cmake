@@ -0,0 +1,88 @@
+# Runs a test program through the CLI and compares what it prints with
+# <NAME>.out. MODULES are compiled first, in order, for the program to import.
+#
+#   run   compile with -c and run the .copl
+#   lazy  the same with COPL_LAZY_IMPORTS=1
+#   link  compile, bundle with -l and run the bundle
+#   cache run with -s, then again after an edit, so the second build takes
+#         its functions from the .funcs file the first one wrote
+#   damaged_cache  the same, but the .funcs files are damaged before each
+#         rebuild, which must then compile everything again
+#
+#   cmake -DCOPL=<exe> -DSOURCE_DIR=<dir> -DWORK_DIR=<dir> -DNAME=<program>
+#         -DMODE=<mode> [-DMODULES=<a;b>] -P run_program.cmake
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+foreach(unit ${MODULES} ${NAME})
+    configure_file(${SOURCE_DIR}/${unit}.opl ${WORK_DIR}/${unit}.opl COPYONLY)
+endforeach()
+
+function(copl)
+    execute_process(COMMAND ${COPL} ${ARGN} WORKING_DIRECTORY ${WORK_DIR}
+            OUTPUT_VARIABLE out ERROR_VARIABLE err RESULT_VARIABLE status)
+    if(NOT status EQUAL 0)
+        list(JOIN ARGN " " command)
+        message(FATAL_ERROR "copl ${command} failed (${status}):\n${out}${err}")
+    endif()
+    set(out "${out}" PARENT_SCOPE)
+endfunction()
+
+function(expect out)
+    file(READ ${SOURCE_DIR}/${NAME}.out want)
+    if(NOT out STREQUAL want)
+        message(FATAL_ERROR "${MODE}: want\n${want}got\n${out}")
+    endif()
+endfunction()
+
+if(MODE STREQUAL "cache")
+    set(ENV{COPL_CACHE_DIR} ${WORK_DIR}/cache)
+    copl(-s ${NAME}.opl)
+    expect("${out}")
+    file(APPEND ${WORK_DIR}/${NAME}.opl "\n")
+    copl(-s ${NAME}.opl)
+    expect("${out}")
+    return()
+endif()
+
+if(MODE STREQUAL "damaged_cache")
+    set(ENV{COPL_CACHE_DIR} ${WORK_DIR}/cache)
+    copl(-s ${NAME}.opl)
+    expect("${out}")
+    file(GLOB funcs ${WORK_DIR}/cache/*.funcs)
+    if(NOT funcs)
+        message(FATAL_ERROR "${MODE}: no .funcs file written")
+    endif()
+    # A valid header and checksum, but counts that run past the end.
+    foreach(f ${funcs})
+        file(COPY_FILE ${SOURCE_DIR}/${NAME}_damaged.funcs ${f})
+    endforeach()
+    file(APPEND ${WORK_DIR}/${NAME}.opl "\n")
+    copl(-s ${NAME}.opl)
+    expect("${out}")
+    # Stray bytes after a good file, which fail the checksum.
+    string(ASCII 255 255 255 255 15 junk)
+    foreach(f ${funcs})
+        file(APPEND ${f} "${junk}")
+    endforeach()
+    file(APPEND ${WORK_DIR}/${NAME}.opl "\n")
+    copl(-s ${NAME}.opl)
+    expect("${out}")
+    return()
+endif()
+
+foreach(unit ${MODULES} ${NAME})
+    copl(-c ${unit}.opl)
+endforeach()
+if(MODE STREQUAL "run")
+    copl(-r ${NAME}.copl)
+elseif(MODE STREQUAL "lazy")
+    set(ENV{COPL_LAZY_IMPORTS} 1)
+    copl(-r ${NAME}.copl)
+elseif(MODE STREQUAL "link")
+    copl(-l ${NAME}.copl)
+    copl(-r ${NAME}.bundle.copl)
+else()
+    message(FATAL_ERROR "unknown mode ${MODE}")
+endif()
+expect("${out}")